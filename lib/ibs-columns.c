@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * Column-oriented (structure-of-arrays) batches of IBS op samples.
+ *
+ * An ibs_op_t is 13 64-bit words, but most online analyses only look at one
+ * or two of them (e.g. op_rip and op_data3). Transposing a batch into one
+ * array per field lets those analyses stream through just the fields they
+ * need, and lets them use SIMD reductions over the columns.
+ *
+ * The transpose itself uses AVX2 4x4 64-bit transposes when the CPU has
+ * them, and a plain loop otherwise.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <immintrin.h>
+
+#include "ibs.h"
+
+#define COLUMN_ALIGN    64
+#define OP_WORDS        (sizeof(ibs_op_t) / sizeof(uint64_t))
+#define OP_U64_COLUMNS  11  /* op_ctl through cr3 */
+
+/* The transposes below walk an ibs_op_t as an array of 64-bit words */
+typedef char op_is_13_words[(sizeof(ibs_op_t) == 13 * sizeof(uint64_t)) ? 1 : -1];
+typedef char tid_is_word_11[(offsetof(ibs_op_t, tid) == 11 * sizeof(uint64_t)) ? 1 : -1];
+typedef char sample_is_op[(sizeof(ibs_sample_t) == sizeof(ibs_op_t)) ? 1 : -1];
+
+/* Column pointers in the same order as the 64-bit words of an ibs_op_t */
+    static void
+ibs_op_u64_columns(ibs_op_columns_t * cols,
+        uint64_t        ** out)
+{
+    out[0]  = cols->op_ctl;
+    out[1]  = cols->rip;
+    out[2]  = cols->data;
+    out[3]  = cols->data2;
+    out[4]  = cols->data3;
+    out[5]  = cols->data4;
+    out[6]  = cols->lin_ad;
+    out[7]  = cols->phys_ad;
+    out[8]  = cols->br_target;
+    out[9]  = cols->tsc;
+    out[10] = cols->cr3;
+}
+
+    ibs_op_columns_t *
+ibs_op_columns_alloc(int capacity)
+{
+    ibs_op_columns_t * cols;
+    uint64_t * u64[OP_U64_COLUMNS];
+    size_t u64_len, i32_len;
+    char * mem;
+    int i;
+
+    if (capacity <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cols = calloc(1, sizeof(ibs_op_columns_t));
+    if (cols == NULL)
+        return NULL;
+
+    /* One allocation, with every column starting on a cache line */
+    u64_len = ((capacity * sizeof(uint64_t)) + COLUMN_ALIGN - 1) & ~(size_t)(COLUMN_ALIGN - 1);
+    i32_len = ((capacity * sizeof(int32_t)) + COLUMN_ALIGN - 1) & ~(size_t)(COLUMN_ALIGN - 1);
+    if (posix_memalign((void **)&mem, COLUMN_ALIGN,
+                OP_U64_COLUMNS * u64_len + 4 * i32_len) != 0) {
+        free(cols);
+        return NULL;
+    }
+
+    cols->capacity = capacity;
+    cols->mem      = mem;
+
+    for (i = 0; i < OP_U64_COLUMNS; i++)
+        u64[i] = (uint64_t *)(mem + i * u64_len);
+    mem += OP_U64_COLUMNS * u64_len;
+
+    cols->op_ctl    = u64[0];
+    cols->rip       = u64[1];
+    cols->data      = u64[2];
+    cols->data2     = u64[3];
+    cols->data3     = u64[4];
+    cols->data4     = u64[5];
+    cols->lin_ad    = u64[6];
+    cols->phys_ad   = u64[7];
+    cols->br_target = u64[8];
+    cols->tsc       = u64[9];
+    cols->cr3       = u64[10];
+    cols->tid       = (int32_t *)(mem);
+    cols->pid       = (int32_t *)(mem + i32_len);
+    cols->cpu       = (int32_t *)(mem + 2 * i32_len);
+    cols->kern_mode = (int32_t *)(mem + 3 * i32_len);
+
+    return cols;
+}
+
+    void
+ibs_op_columns_free(ibs_op_columns_t * cols)
+{
+    if (cols == NULL)
+        return;
+
+    free(cols->mem);
+    free(cols->scratch);
+    free(cols->scratch_types);
+    free(cols);
+}
+
+    static void
+transpose_scalar(const uint64_t * words,
+        int               first,
+        int               num_ops,
+        uint64_t       ** u64,
+        ibs_op_columns_t * cols)
+{
+    int i, w;
+
+    for (w = 0; w < OP_U64_COLUMNS; w++) {
+        uint64_t * col = u64[w];
+        for (i = first; i < num_ops; i++)
+            col[i] = words[i * OP_WORDS + w];
+    }
+
+    for (i = first; i < num_ops; i++) {
+        const ibs_op_t * op = (const ibs_op_t *)(words + i * OP_WORDS);
+        cols->tid[i]       = op->tid;
+        cols->pid[i]       = op->pid;
+        cols->cpu[i]       = op->cpu;
+        cols->kern_mode[i] = op->kern_mode;
+    }
+}
+
+/* Transpose words [w, w+4) of four consecutive ops into four columns */
+    __attribute__((target("avx2"))) static inline void
+transpose_4x4(const uint64_t * rec,
+        int               w,
+        __m256i         * c0,
+        __m256i         * c1,
+        __m256i         * c2,
+        __m256i         * c3)
+{
+    __m256i r0 = _mm256_loadu_si256((const __m256i *)(rec + 0 * OP_WORDS + w));
+    __m256i r1 = _mm256_loadu_si256((const __m256i *)(rec + 1 * OP_WORDS + w));
+    __m256i r2 = _mm256_loadu_si256((const __m256i *)(rec + 2 * OP_WORDS + w));
+    __m256i r3 = _mm256_loadu_si256((const __m256i *)(rec + 3 * OP_WORDS + w));
+
+    __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+
+    *c0 = _mm256_permute2x128_si256(t0, t2, 0x20);
+    *c1 = _mm256_permute2x128_si256(t1, t3, 0x20);
+    *c2 = _mm256_permute2x128_si256(t0, t2, 0x31);
+    *c3 = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+    __attribute__((target("avx2"))) static int
+transpose_avx2(const uint64_t * words,
+        int               num_ops,
+        uint64_t       ** u64,
+        ibs_op_columns_t * cols)
+{
+    const __m256i lo_dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    int i;
+
+    for (i = 0; i + 4 <= num_ops; i += 4) {
+        const uint64_t * rec = words + i * OP_WORDS;
+        __m256i c0, c1, c2, c3, ids, last;
+
+        transpose_4x4(rec, 0, &c0, &c1, &c2, &c3);
+        _mm256_storeu_si256((__m256i *)(u64[0] + i), c0);
+        _mm256_storeu_si256((__m256i *)(u64[1] + i), c1);
+        _mm256_storeu_si256((__m256i *)(u64[2] + i), c2);
+        _mm256_storeu_si256((__m256i *)(u64[3] + i), c3);
+
+        transpose_4x4(rec, 4, &c0, &c1, &c2, &c3);
+        _mm256_storeu_si256((__m256i *)(u64[4] + i), c0);
+        _mm256_storeu_si256((__m256i *)(u64[5] + i), c1);
+        _mm256_storeu_si256((__m256i *)(u64[6] + i), c2);
+        _mm256_storeu_si256((__m256i *)(u64[7] + i), c3);
+
+        /* Word 11 holds tid (low) and pid (high) */
+        transpose_4x4(rec, 8, &c0, &c1, &c2, &ids);
+        _mm256_storeu_si256((__m256i *)(u64[8] + i), c0);
+        _mm256_storeu_si256((__m256i *)(u64[9] + i), c1);
+        _mm256_storeu_si256((__m256i *)(u64[10] + i), c2);
+
+        ids = _mm256_permutevar8x32_epi32(ids, lo_dwords);
+        _mm_storeu_si128((__m128i *)(cols->tid + i), _mm256_castsi256_si128(ids));
+        _mm_storeu_si128((__m128i *)(cols->pid + i), _mm256_extracti128_si256(ids, 1));
+
+        /* Word 12 holds cpu (low) and kern_mode (high) */
+        last = _mm256_setr_epi64x(rec[12], rec[OP_WORDS + 12],
+                rec[2 * OP_WORDS + 12], rec[3 * OP_WORDS + 12]);
+        last = _mm256_permutevar8x32_epi32(last, lo_dwords);
+        _mm_storeu_si128((__m128i *)(cols->cpu + i), _mm256_castsi256_si128(last));
+        _mm_storeu_si128((__m128i *)(cols->kern_mode + i), _mm256_extracti128_si256(last, 1));
+    }
+
+    return i;
+}
+
+    int
+ibs_op_columns_transpose(ibs_op_columns_t * cols,
+        const ibs_op_t   * ops,
+        int                num_ops)
+{
+    static int have_avx2 = -1;
+    uint64_t * u64[OP_U64_COLUMNS];
+    const uint64_t * words = (const uint64_t *)ops;
+    int done = 0;
+
+    if (num_ops > cols->capacity)
+        num_ops = cols->capacity;
+
+    if (have_avx2 < 0) {
+        __builtin_cpu_init();
+        have_avx2 = __builtin_cpu_supports("avx2");
+    }
+
+    ibs_op_u64_columns(cols, u64);
+
+    if (have_avx2)
+        done = transpose_avx2(words, num_ops, u64, cols);
+
+    /* Whatever is left over (or everything, without AVX2) */
+    transpose_scalar(words, done, num_ops, u64, cols);
+
+    cols->count = num_ops;
+    return num_ops;
+}
+
+    int
+ibs_sample_columns(int                max_samples,
+        ibs_op_columns_t * cols)
+{
+    int num_samples;
+
+    if (max_samples > cols->capacity)
+        max_samples = cols->capacity;
+
+    /* Read into our own scratch space, which only ever grows */
+    if (cols->scratch_len < max_samples) {
+        free(cols->scratch);
+        free(cols->scratch_types);
+        cols->scratch       = malloc(sizeof(ibs_sample_t) * max_samples);
+        cols->scratch_types = malloc(sizeof(ibs_sample_type_t) * max_samples);
+        cols->scratch_len   = max_samples;
+        if (cols->scratch == NULL || cols->scratch_types == NULL) {
+            free(cols->scratch);
+            free(cols->scratch_types);
+            cols->scratch       = NULL;
+            cols->scratch_types = NULL;
+            cols->scratch_len   = 0;
+            return -1;
+        }
+    }
+
+    num_samples = ibs_sample(max_samples, IBS_OP_SAMPLE, cols->scratch,
+            cols->scratch_types);
+    if (num_samples <= 0) {
+        cols->count = 0;
+        return num_samples;
+    }
+
+    return ibs_op_columns_transpose(cols, (const ibs_op_t *)cols->scratch,
+            num_samples);
+}
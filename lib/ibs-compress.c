@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * Block compression of IBS sample traces.
+ *
+ * Raw samples are very redundant from one to the next: the TSC only moves
+ * forward a little, cpu/pid/tid/cr3 rarely change, and many of the
+ * register fields are mostly zero. A block is compressed one 64-bit word
+ * column at a time. Each column is stored either as the XOR with the same
+ * word of the previous sample (good for IDs and bitfields) or as the
+ * zigzag-encoded difference from it (good for counters such as the TSC),
+ * whichever is smaller. Values are written as LEB128 varints, and runs of
+ * zeros collapse into a zero followed by the run length.
+ *
+ * This needs no external library, and a 4 MB block of samples compresses
+ * in a few milliseconds.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ibs.h"
+
+#define MAX_VARINT  10
+
+enum {
+    COLUMN_XOR   = 0,
+    COLUMN_DELTA = 1
+};
+
+    static inline uint64_t
+zigzag(uint64_t delta)
+{
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+    static inline uint64_t
+unzigzag(uint64_t val)
+{
+    return (val >> 1) ^ (0 - (val & 1));
+}
+
+    static inline uint8_t *
+put_varint(uint8_t * out, uint64_t val)
+{
+    while (val >= 0x80) {
+        *out++ = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    *out++ = (uint8_t)val;
+    return out;
+}
+
+    static inline int
+varint_len(uint64_t val)
+{
+    int len = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        len++;
+    }
+    return len;
+}
+
+    static inline const uint8_t *
+get_varint(const uint8_t * in, const uint8_t * end, uint64_t * val)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (in < end && shift < 64) {
+        uint8_t b = *in++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *val = v;
+            return in;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/* The value stored for sample i of a column, before the zero-run coding */
+    static inline uint64_t
+column_value(const uint64_t * words, size_t stride, uint32_t i, int mode)
+{
+    uint64_t cur  = words[i * stride];
+    uint64_t prev = i ? words[(i - 1) * stride] : 0;
+    return (mode == COLUMN_XOR) ? (cur ^ prev) : zigzag(cur - prev);
+}
+
+/* How many bytes a column takes in the given mode, to choose between them */
+    static size_t
+column_size(const uint64_t * words, size_t stride, uint32_t num, int mode)
+{
+    size_t len = 0;
+    uint32_t i = 0;
+
+    while (i < num) {
+        uint64_t v = column_value(words, stride, i, mode);
+        if (v == 0) {
+            uint32_t run = 1;
+            while (i + run < num && column_value(words, stride, i + run, mode) == 0)
+                run++;
+            len += 1 + varint_len(run - 1);
+            i += run;
+        } else {
+            len += varint_len(v);
+            i++;
+        }
+    }
+    return len;
+}
+
+    static uint8_t *
+put_column(uint8_t * out, const uint64_t * words, size_t stride, uint32_t num,
+        int mode)
+{
+    uint32_t i = 0;
+
+    *out++ = (uint8_t)mode;
+    while (i < num) {
+        uint64_t v = column_value(words, stride, i, mode);
+        if (v == 0) {
+            uint32_t run = 1;
+            while (i + run < num && column_value(words, stride, i + run, mode) == 0)
+                run++;
+            *out++ = 0;
+            out = put_varint(out, run - 1);
+            i += run;
+        } else {
+            out = put_varint(out, v);
+            i++;
+        }
+    }
+    return out;
+}
+
+    static const uint8_t *
+get_column(const uint8_t * in, const uint8_t * end, uint64_t * words,
+        size_t stride, uint32_t num)
+{
+    uint64_t prev = 0;
+    uint32_t i = 0;
+    int mode;
+
+    if (in >= end)
+        return NULL;
+    mode = *in++;
+    if (mode != COLUMN_XOR && mode != COLUMN_DELTA)
+        return NULL;
+
+    while (i < num) {
+        uint64_t v, run = 0;
+
+        in = get_varint(in, end, &v);
+        if (in == NULL)
+            return NULL;
+        if (v == 0) {
+            in = get_varint(in, end, &run);
+            if (in == NULL || run >= num - i)
+                return NULL;
+        }
+
+        /* A run of zeros repeats the previous word (XOR) or adds 0 (delta) */
+        do {
+            uint64_t cur = (mode == COLUMN_XOR) ? (prev ^ v) : (prev + unzigzag(v));
+            words[i * stride] = cur;
+            prev = cur;
+            i++;
+        } while (run-- > 0);
+    }
+    return in;
+}
+
+    size_t
+ibs_compress_bound(size_t sample_size, uint32_t num_samples)
+{
+    size_t words = sample_size / sizeof(uint64_t);
+    /* Worst case is a full varint for every word, plus a mode byte each */
+    return sizeof(ibs_z_block_t) + words * (1 + (size_t)num_samples * MAX_VARINT);
+}
+
+    ssize_t
+ibs_compress_samples(const void * samples,
+        size_t       sample_size,
+        uint32_t     num_samples,
+        void       * out,
+        size_t       out_len)
+{
+    const uint64_t * words = samples;
+    size_t stride = sample_size / sizeof(uint64_t);
+    ibs_z_block_t * hdr = out;
+    uint8_t * p;
+    size_t w;
+
+    if (sample_size == 0 || sample_size % sizeof(uint64_t) != 0 ||
+            out_len < ibs_compress_bound(sample_size, num_samples)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = (uint8_t *)(hdr + 1);
+    for (w = 0; w < stride; w++) {
+        int mode = COLUMN_XOR;
+        if (column_size(words + w, stride, num_samples, COLUMN_DELTA) <
+                column_size(words + w, stride, num_samples, COLUMN_XOR))
+            mode = COLUMN_DELTA;
+        p = put_column(p, words + w, stride, num_samples, mode);
+    }
+
+    memcpy(hdr->magic, IBS_Z_MAGIC, sizeof(hdr->magic));
+    hdr->sample_size  = sample_size;
+    hdr->num_samples  = num_samples;
+    hdr->payload_size = p - (uint8_t *)(hdr + 1);
+    return p - (uint8_t *)out;
+}
+
+    int
+ibs_decompress_samples(const ibs_z_block_t * block,
+        const void          * payload,
+        void                * samples,
+        size_t                samples_len)
+{
+    const uint8_t * in  = payload;
+    const uint8_t * end = in + block->payload_size;
+    size_t stride = block->sample_size / sizeof(uint64_t);
+    size_t w;
+
+    if (memcmp(block->magic, IBS_Z_MAGIC, sizeof(block->magic)) != 0 ||
+            block->sample_size == 0 ||
+            block->sample_size % sizeof(uint64_t) != 0 ||
+            (size_t)block->num_samples * block->sample_size > samples_len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (w = 0; w < stride; w++) {
+        in = get_column(in, end, (uint64_t *)samples + w, stride,
+                block->num_samples);
+        if (in == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    return block->num_samples;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * Dynamically sized CPU sets for libIBS. A set holds one bit per possible
+ * CPU, packed into word_t words, so that machines with hundreds or thousands
+ * of CPUs can be described without fixed-size masks. Sets can be parsed from
+ * (and printed to) the same list format the kernel uses in sysfs, e.g.
+ * "0-63,128-191".
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+#include "ibs.h"
+
+#define WORDS_FOR_BITS(b) (((b) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+    ibs_cpu_set_t *
+ibs_cpu_set_alloc(int num_cpus)
+{
+    ibs_cpu_set_t * set;
+
+    if (num_cpus <= 0)
+        num_cpus = get_nprocs_conf();
+
+    set = malloc(sizeof(ibs_cpu_set_t));
+    if (set == NULL)
+        return NULL;
+
+    set->num_cpus  = num_cpus;
+    set->num_words = WORDS_FOR_BITS(num_cpus);
+    set->words     = calloc(set->num_words, sizeof(word_t));
+    if (set->words == NULL) {
+        free(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+    void
+ibs_cpu_set_free(ibs_cpu_set_t * set)
+{
+    if (set == NULL)
+        return;
+
+    free(set->words);
+    free(set);
+}
+
+    void
+ibs_cpu_set_zero(ibs_cpu_set_t * set)
+{
+    memset(set->words, 0, set->num_words * sizeof(word_t));
+}
+
+    void
+ibs_cpu_set_fill(ibs_cpu_set_t * set)
+{
+    int tail = BIT_OFFSET(set->num_cpus);
+
+    memset(set->words, 0xff, set->num_words * sizeof(word_t));
+
+    /* Never report CPUs past the end of the set */
+    if (tail != 0)
+        set->words[set->num_words - 1] = ((word_t)1 << tail) - 1;
+}
+
+    int
+ibs_cpu_set_add(ibs_cpu_set_t * set,
+        int             cpu)
+{
+    if (cpu < 0 || cpu >= set->num_cpus)
+        return -1;
+
+    SET_BIT(set->words[0], cpu);
+    return 0;
+}
+
+    int
+ibs_cpu_set_remove(ibs_cpu_set_t * set,
+        int             cpu)
+{
+    if (cpu < 0 || cpu >= set->num_cpus)
+        return -1;
+
+    CLEAR_BIT(set->words[0], cpu);
+    return 0;
+}
+
+    int
+ibs_cpu_set_is_set(const ibs_cpu_set_t * set,
+        int                   cpu)
+{
+    if (set == NULL || cpu < 0 || cpu >= set->num_cpus)
+        return 0;
+
+    return IS_BIT_SET(set->words[0], cpu);
+}
+
+    int
+ibs_cpu_set_count(const ibs_cpu_set_t * set)
+{
+    int i, count = 0;
+
+    for (i = 0; i < set->num_words; i++)
+        count += __builtin_popcountll(set->words[i]);
+
+    return count;
+}
+
+    int
+ibs_cpu_set_next(const ibs_cpu_set_t * set,
+        int                   prev)
+{
+    int cpu = prev + 1;
+    int word;
+    word_t bits;
+
+    if (cpu < 0)
+        cpu = 0;
+    if (cpu >= set->num_cpus)
+        return -1;
+
+    /* Mask off the bits at and below prev in the first word we look at,
+     * then skip whole empty words until we find a set bit. */
+    word = WORD_OFFSET(cpu);
+    bits = set->words[word] & (~(word_t)0 << BIT_OFFSET(cpu));
+
+    while (bits == 0) {
+        if (++word >= set->num_words)
+            return -1;
+        bits = set->words[word];
+    }
+
+    cpu = word * BITS_PER_WORD + __builtin_ctzll(bits);
+    return (cpu < set->num_cpus) ? cpu : -1;
+}
+
+    int
+ibs_cpu_set_last(const ibs_cpu_set_t * set)
+{
+    int word;
+
+    for (word = set->num_words - 1; word >= 0; word--) {
+        if (set->words[word] != 0)
+            return word * BITS_PER_WORD + (BITS_PER_WORD - 1) -
+                __builtin_clzll(set->words[word]);
+    }
+
+    return -1;
+}
+
+    int
+ibs_cpu_set_copy(ibs_cpu_set_t       * dst,
+        const ibs_cpu_set_t * src)
+{
+    int i;
+
+    ibs_cpu_set_zero(dst);
+    for (i = 0; i < dst->num_words && i < src->num_words; i++)
+        dst->words[i] = src->words[i];
+
+    /* Drop anything from src that does not fit into dst */
+    if (BIT_OFFSET(dst->num_cpus) != 0 && src->num_cpus > dst->num_cpus)
+        dst->words[dst->num_words - 1] &=
+            ((word_t)1 << BIT_OFFSET(dst->num_cpus)) - 1;
+
+    return 0;
+}
+
+    void
+ibs_cpu_set_and(ibs_cpu_set_t       * dst,
+        const ibs_cpu_set_t * src)
+{
+    int i;
+
+    for (i = 0; i < dst->num_words; i++) {
+        if (i < src->num_words)
+            dst->words[i] &= src->words[i];
+        else
+            dst->words[i] = 0;
+    }
+}
+
+    int
+ibs_cpu_set_parse(ibs_cpu_set_t * set,
+        const char    * list)
+{
+    const char * p = list;
+
+    ibs_cpu_set_zero(set);
+
+    while (*p != '\0' && *p != '\n') {
+        char * end;
+        long first, last, cpu;
+
+        while (isspace((unsigned char)*p))
+            p++;
+
+        if (!isdigit((unsigned char)*p))
+            goto bad_list;
+
+        first = strtol(p, &end, 10);
+        last  = first;
+        p     = end;
+
+        if (*p == '-') {
+            p++;
+            if (!isdigit((unsigned char)*p))
+                goto bad_list;
+            last = strtol(p, &end, 10);
+            p    = end;
+        }
+
+        if (last < first || last >= set->num_cpus)
+            goto bad_list;
+
+        for (cpu = first; cpu <= last; cpu++)
+            SET_BIT(set->words[0], cpu);
+
+        while (isspace((unsigned char)*p) && *p != '\n')
+            p++;
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            goto bad_list;
+    }
+
+    return 0;
+
+bad_list:
+    errno = EINVAL;
+    return -1;
+}
+
+    int
+ibs_cpu_set_print(const ibs_cpu_set_t * set,
+        char                * buf,
+        int                   buf_len)
+{
+    int cpu, off = 0;
+
+    if (buf_len <= 0)
+        return -1;
+    buf[0] = '\0';
+
+    cpu = ibs_cpu_set_next(set, -1);
+    while (cpu >= 0) {
+        int last = cpu, next, n;
+
+        /* Find the end of this run of consecutive CPUs */
+        while ((next = ibs_cpu_set_next(set, last)) == last + 1)
+            last = next;
+
+        if (last == cpu)
+            n = snprintf(buf + off, buf_len - off, "%s%d",
+                    off ? "," : "", cpu);
+        else
+            n = snprintf(buf + off, buf_len - off, "%s%d-%d",
+                    off ? "," : "", cpu, last);
+
+        if (n < 0 || n >= buf_len - off)
+            return -1;
+        off += n;
+
+        cpu = next;
+    }
+
+    return off;
+}
+
+    int
+ibs_cpu_set_online(ibs_cpu_set_t * set)
+{
+    FILE * online_fp;
+    char * online_cpus = NULL;
+    size_t len = 0;
+    int status;
+
+    /* Older kernels may not have this file, in which case every CPU that
+     * has ever been configured is assumed to be online. */
+    online_fp = fopen("/sys/devices/system/cpu/online", "r");
+    if (online_fp == NULL) {
+        ibs_cpu_set_zero(set);
+        for (int cpu = 0; cpu < get_nprocs() && cpu < set->num_cpus; cpu++)
+            ibs_cpu_set_add(set, cpu);
+        return 0;
+    }
+
+    if (getline(&online_cpus, &len, online_fp) == -1) {
+        fclose(online_fp);
+        free(online_cpus);
+        return -1;
+    }
+    fclose(online_fp);
+
+    status = ibs_cpu_set_parse(set, online_cpus);
+    free(online_cpus);
+    return status;
+}
@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * A POSIX shared-memory ring that lets one process (the broker) own the IBS
+ * devices while many other processes read the same stream of samples.
+ *
+ * The ring has a single writer and up to IBS_RING_MAX_READERS readers. The
+ * writer never waits for readers: it overwrites the oldest samples, and each
+ * reader notices how far it fell behind and adds that to its own drop
+ * counter. Every reader has its own cursor and drop counter in the shared
+ * segment, so the broker (or anyone else) can see how each consumer is doing.
+ *
+ * Torn reads are detected with a seqlock-style pair of counters: the writer
+ * bumps 'reserve' before it overwrites any slots and 'head' once they are
+ * complete. A reader copies slots out and then re-reads 'reserve'; anything
+ * it copied that the writer may have started overwriting is thrown away and
+ * counted as dropped.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "ibs.h"
+
+#define IBS_RING_MAGIC    0x49425352U /* "IBSR" */
+#define IBS_RING_VERSION  1
+#define CACHE_LINE        64
+
+typedef struct ibs_ring_slot {
+    ibs_sample_t      sample;
+    ibs_sample_type_t type;
+} ibs_ring_slot_t;
+
+/* Layout of the shared segment. Counters that different processes write are
+ * kept on their own cache lines. */
+typedef struct ibs_ring_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;      /* Slots, always a power of two */
+    uint32_t slot_size;
+    pid_t    broker_pid;
+
+    uint64_t reserve  __attribute__((aligned(CACHE_LINE)));
+    uint64_t head     __attribute__((aligned(CACHE_LINE)));
+    uint32_t futex    __attribute__((aligned(CACHE_LINE)));
+    uint32_t waiters;
+
+    ibs_ring_reader_t readers[IBS_RING_MAX_READERS];
+
+    ibs_ring_slot_t slots[] __attribute__((aligned(CACHE_LINE)));
+} ibs_ring_shm_t;
+
+struct ibs_ring {
+    ibs_ring_shm_t * shm;
+    size_t           map_len;
+    int              reader;   /* Reader slot, or -1 for the writer */
+    char           * name;
+};
+
+
+#define ibs_ring_error_no(fmt, ...)  \
+    fprintf(stderr, "IBS_ERROR [%s:%d:%s]: "fmt": %s\n", __FILE__, __LINE__, __func__, __VA_ARGS__, strerror(errno));
+
+
+    static size_t
+ibs_ring_map_len(uint64_t capacity)
+{
+    return sizeof(ibs_ring_shm_t) + capacity * sizeof(ibs_ring_slot_t);
+}
+
+    static char *
+ibs_ring_shm_name(const char * name)
+{
+    char * shm_name;
+
+    /* shm_open() wants a single leading slash */
+    if (asprintf(&shm_name, "/%s", (name[0] == '/') ? name + 1 : name) < 0)
+        return NULL;
+
+    return shm_name;
+}
+
+    static void
+ibs_ring_futex_wake(ibs_ring_shm_t * shm)
+{
+    __atomic_add_fetch(&shm->futex, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&shm->waiters, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &shm->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+    ibs_ring_t *
+ibs_ring_create(const char    * name,
+        unsigned long   num_samples)
+{
+    ibs_ring_t * ring;
+    uint64_t capacity = 1;
+    int fd;
+
+    /* Round up so that slot indices are a simple mask */
+    while (capacity < num_samples)
+        capacity <<= 1;
+
+    ring = calloc(1, sizeof(ibs_ring_t));
+    if (ring == NULL)
+        return NULL;
+
+    ring->name   = ibs_ring_shm_name(name);
+    ring->reader = -1;
+    if (ring->name == NULL)
+        goto err;
+
+    fd = shm_open(ring->name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        ibs_ring_error_no("Cannot create shared memory ring %s", ring->name);
+        goto err;
+    }
+
+    ring->map_len = ibs_ring_map_len(capacity);
+    if (ftruncate(fd, ring->map_len) < 0) {
+        ibs_ring_error_no("Cannot size shared memory ring %s", ring->name);
+        close(fd);
+        shm_unlink(ring->name);
+        goto err;
+    }
+
+    ring->shm = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (ring->shm == MAP_FAILED) {
+        ibs_ring_error_no("Cannot map shared memory ring %s", ring->name);
+        shm_unlink(ring->name);
+        goto err;
+    }
+
+    ring->shm->capacity   = capacity;
+    ring->shm->slot_size  = sizeof(ibs_ring_slot_t);
+    ring->shm->version    = IBS_RING_VERSION;
+    ring->shm->broker_pid = getpid();
+
+    /* Readers check the magic number last */
+    __atomic_store_n(&ring->shm->magic, IBS_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+
+err:
+    free(ring->name);
+    free(ring);
+    return NULL;
+}
+
+    void
+ibs_ring_publish(ibs_ring_t        * ring,
+        const ibs_sample_t      * samples,
+        const ibs_sample_type_t * sample_types,
+        int                       num_samples)
+{
+    ibs_ring_shm_t * shm = ring->shm;
+    uint64_t mask = shm->capacity - 1;
+    uint64_t head = shm->head;
+    int i;
+
+    if (num_samples <= 0)
+        return;
+
+    /* Anything older than the last 'capacity' samples would be overwritten
+     * in this same batch, so don't bother writing it. */
+    if ((uint64_t)num_samples > shm->capacity) {
+        uint64_t skip = num_samples - shm->capacity;
+        samples      += skip;
+        sample_types += skip;
+        head         += skip;
+        num_samples   = shm->capacity;
+    }
+
+    /* Tell readers which slots are about to change before changing them */
+    __atomic_store_n(&shm->reserve, head + num_samples, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (i = 0; i < num_samples; i++) {
+        ibs_ring_slot_t * slot = &(shm->slots[(head + i) & mask]);
+        slot->sample = samples[i];
+        slot->type   = sample_types[i];
+    }
+
+    __atomic_store_n(&shm->head, head + num_samples, __ATOMIC_RELEASE);
+    ibs_ring_futex_wake(shm);
+}
+
+    void
+ibs_ring_destroy(ibs_ring_t * ring)
+{
+    if (ring == NULL)
+        return;
+
+    if (ring->reader < 0) {
+        /* Wake anyone still waiting so they see the broker is gone */
+        ring->shm->broker_pid = 0;
+        ibs_ring_futex_wake(ring->shm);
+        shm_unlink(ring->name);
+    }
+
+    munmap(ring->shm, ring->map_len);
+    free(ring->name);
+    free(ring);
+}
+
+    ibs_ring_t *
+ibs_ring_attach(const char * name)
+{
+    ibs_ring_t * ring;
+    ibs_ring_shm_t * shm;
+    struct stat st;
+    int fd, i;
+
+    ring = calloc(1, sizeof(ibs_ring_t));
+    if (ring == NULL)
+        return NULL;
+
+    ring->name = ibs_ring_shm_name(name);
+    if (ring->name == NULL)
+        goto err;
+
+    fd = shm_open(ring->name, O_RDWR, 0);
+    if (fd < 0)
+        goto err;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ibs_ring_shm_t)) {
+        close(fd);
+        errno = EPROTO;
+        goto err;
+    }
+
+    ring->map_len = st.st_size;
+    shm = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        goto err;
+    ring->shm = shm;
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != IBS_RING_MAGIC ||
+            shm->version != IBS_RING_VERSION ||
+            shm->slot_size != sizeof(ibs_ring_slot_t) ||
+            ibs_ring_map_len(shm->capacity) > ring->map_len) {
+        errno = EPROTO;
+        goto err_unmap;
+    }
+
+    /* Claim a free reader slot, reclaiming ones whose owner has died. The
+     * owner's pid is what is claimed: only one attacher can swap it from 0
+     * or from a given dead pid to its own, so no two can win the same slot.
+     * in_use is set once the slot is ready, for ibs_ring_get_readers(). */
+    for (i = 0; i < IBS_RING_MAX_READERS; i++) {
+        ibs_ring_reader_t * r = &(shm->readers[i]);
+        int32_t owner = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+
+        if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+            continue;
+
+        if (__atomic_compare_exchange_n(&r->pid, &owner, (int32_t)getpid(),
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+            r->dropped = 0;
+            /* New readers only see samples published after they attach */
+            __atomic_store_n(&r->cursor,
+                    __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE),
+                    __ATOMIC_RELEASE);
+            __atomic_store_n(&r->in_use, 1, __ATOMIC_RELEASE);
+            ring->reader = i;
+            return ring;
+        }
+    }
+
+    errno = EBUSY;
+
+err_unmap:
+    munmap(ring->shm, ring->map_len);
+err:
+    free(ring->name);
+    free(ring);
+    return NULL;
+}
+
+    void
+ibs_ring_detach(ibs_ring_t * ring)
+{
+    if (ring == NULL)
+        return;
+
+    if (ring->reader >= 0) {
+        ibs_ring_reader_t * r = &(ring->shm->readers[ring->reader]);
+        __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->pid, 0, __ATOMIC_RELEASE);
+    }
+
+    munmap(ring->shm, ring->map_len);
+    free(ring->name);
+    free(ring);
+}
+
+    int
+ibs_ring_read(ibs_ring_t        * ring,
+        int                 max_samples,
+        ibs_sample_t      * samples,
+        ibs_sample_type_t * sample_types)
+{
+    ibs_ring_shm_t * shm;
+    ibs_ring_reader_t * r;
+    uint64_t mask, head, cursor, reserve, first_valid, n, i;
+
+    if (ring == NULL || ring->reader < 0 || max_samples <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    shm    = ring->shm;
+    r      = &(shm->readers[ring->reader]);
+    mask   = shm->capacity - 1;
+    cursor = r->cursor;
+    head   = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+
+    /* Lapped by the writer: skip ahead to the oldest sample still there */
+    if (head - cursor > shm->capacity) {
+        r->dropped += head - shm->capacity - cursor;
+        cursor = head - shm->capacity;
+    }
+
+    n = head - cursor;
+    if (n > (uint64_t)max_samples)
+        n = max_samples;
+
+    for (i = 0; i < n; i++) {
+        const ibs_ring_slot_t * slot = &(shm->slots[(cursor + i) & mask]);
+        samples[i]      = slot->sample;
+        sample_types[i] = slot->type;
+    }
+
+    /* Anything the writer may have started to overwrite while we were
+     * copying is unreliable. Drop it from the front of what we read. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    reserve     = __atomic_load_n(&shm->reserve, __ATOMIC_RELAXED);
+    first_valid = (reserve > shm->capacity) ? reserve - shm->capacity : 0;
+
+    if (cursor < first_valid) {
+        uint64_t bad = first_valid - cursor;
+        if (bad > n)
+            bad = n;
+
+        memmove(samples, samples + bad, (n - bad) * sizeof(ibs_sample_t));
+        memmove(sample_types, sample_types + bad,
+                (n - bad) * sizeof(ibs_sample_type_t));
+        r->dropped += first_valid - cursor;
+        n      -= bad;
+        cursor  = first_valid;
+    }
+
+    __atomic_store_n(&r->cursor, cursor + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+    int
+ibs_ring_wait(ibs_ring_t * ring,
+        int          timeout_ms)
+{
+    ibs_ring_shm_t * shm = ring->shm;
+    ibs_ring_reader_t * r = &(shm->readers[ring->reader]);
+    struct timespec ts, * tsp = NULL;
+    uint32_t seen;
+    int ret = 0;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+
+    __atomic_add_fetch(&shm->waiters, 1, __ATOMIC_ACQ_REL);
+    seen = __atomic_load_n(&shm->futex, __ATOMIC_ACQUIRE);
+
+    /* Only sleep if there really is nothing new */
+    if (__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) == r->cursor &&
+            shm->broker_pid != 0) {
+        if (syscall(SYS_futex, &shm->futex, FUTEX_WAIT, seen, tsp, NULL, 0) < 0
+                && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+            ret = -1;
+    }
+
+    __atomic_sub_fetch(&shm->waiters, 1, __ATOMIC_ACQ_REL);
+
+    if (ret == 0 && shm->broker_pid == 0) {
+        errno = EPIPE;
+        ret = -1;
+    }
+
+    return ret;
+}
+
+    unsigned long
+ibs_ring_dropped(const ibs_ring_t * ring)
+{
+    if (ring == NULL || ring->reader < 0)
+        return 0;
+
+    return ring->shm->readers[ring->reader].dropped;
+}
+
+    int
+ibs_ring_get_readers(const ibs_ring_t  * ring,
+        ibs_ring_reader_t * readers,
+        int                 max_readers)
+{
+    int i, n = 0;
+
+    for (i = 0; i < IBS_RING_MAX_READERS && n < max_readers; i++) {
+        const ibs_ring_reader_t * r = &(ring->shm->readers[i]);
+        if (__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE))
+            readers[n++] = *r;
+    }
+
+    return n;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * Converting sample TSCs to clock times.
+ *
+ * Traces record anchors, each a TSC read next to the clocks, and a TSC is
+ * turned into a time by drawing a line through the two anchors around it.
+ * The slope is a ratio of two 64-bit spans, so the product of the TSC
+ * delta and the clock span can need more than 64 bits. ISO C has no wider
+ * integer, so the delta is split into whole TSC spans, which are scaled
+ * exactly, and a remainder, which is scaled in 64 bits when that cannot
+ * overflow and otherwise in long double, then corrected to the exact
+ * result.
+ */
+#include <stdint.h>
+
+#include "ibs.h"
+
+/* floor(a * b / c) for c != 0 */
+    static uint64_t
+scale(uint64_t a, uint64_t b, uint64_t c)
+{
+    uint64_t whole = a / c, rest = a % c;
+    uint64_t part;
+    int64_t left;
+
+    if (b == 0 || rest <= UINT64_MAX / b)
+        return whole * b + rest * b / c;
+
+    /* long double can round part off by one. What is left over of
+     * rest * b, which fits in 64 bits, says which way to move it. */
+    part = (uint64_t)((long double)rest * b / c);
+    if (c <= INT64_MAX / 4) {
+        left = (int64_t)(rest * b - part * c);
+        while (left < 0) {
+            part--;
+            left += c;
+        }
+        while (left >= (int64_t)c) {
+            part++;
+            left -= c;
+        }
+    }
+    return whole * b + part;
+}
+
+    static uint64_t
+magnitude(int64_t v)
+{
+    return v < 0 ? -(uint64_t)v : (uint64_t)v;
+}
+
+    uint64_t
+ibs_tsc_to_ns(uint64_t tsc, uint64_t from_tsc, uint64_t from_ns,
+        int64_t span_tsc, int64_t span_ns)
+{
+    int64_t delta = (int64_t)(tsc - from_tsc);
+    int backwards = (delta < 0) ^ (span_ns < 0) ^ (span_tsc < 0);
+    uint64_t moved;
+
+    if (span_tsc == 0)
+        return from_ns;
+    moved = scale(magnitude(delta), magnitude(span_ns), magnitude(span_tsc));
+    /* Rounded towards from_ns, as a signed division would be */
+    if (backwards)
+        return from_ns - moved;
+    return from_ns + moved;
+}
@@ -19,12 +19,16 @@
 #include <stdint.h>
 #include <assert.h>
 #include <sys/sysinfo.h>
+#include <sched.h>
+#include <time.h>
 
 #include "ibs.h"
 #include "ibs-uapi.h"
 
 #define MSEC_PER_SEC  1000
 #define USEC_PER_MSEC 1000
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
 
 
 static unsigned char ibs_debug_on           = DEFAULT_IBS_DEBUG;
@@ -36,12 +40,16 @@ static unsigned long ibs_poll_timeout       = DEFAULT_IBS_POLL_TIMEOUT;
 static unsigned long ibs_poll_num_samples   = DEFAULT_IBS_POLL_NUM_SAMPLES;
 static unsigned long ibs_max_cnt            = DEFAULT_IBS_MAX_CNT;
 
-static char * ibs_cpu_list = NULL;
+static ibs_cpu_set_t * ibs_cpu_list        = DEFAULT_IBS_CPU_LIST;
 
 static unsigned long ibs_daemon_max_samples = DEFAULT_IBS_DAEMON_MAX_SAMPLES;
-static word_t ibs_daemon_cpu_list           = DEFAULT_IBS_DAEMON_CPU_LIST;
+static ibs_cpu_set_t * ibs_daemon_cpu_list  = DEFAULT_IBS_DAEMON_CPU_LIST;
 static char * ibs_daemon_op_file            = DEFAULT_IBS_DAEMON_OP_FILE;
 static char * ibs_daemon_fetch_file         = DEFAULT_IBS_DAEMON_FETCH_FILE;
+static char * ibs_daemon_ring_name          = DEFAULT_IBS_DAEMON_RING_NAME;
+static unsigned long ibs_daemon_ring_samples = DEFAULT_IBS_DAEMON_RING_SAMPLES;
+static unsigned long ibs_daemon_stats_interval = DEFAULT_IBS_DAEMON_STATS_INTERVAL;
+static char * ibs_daemon_stats_file         = DEFAULT_IBS_DAEMON_STATS_FILE;
 
 
     static void
@@ -70,6 +78,7 @@ typedef struct ibs_cpu {
     int fetch_enabled;
     int fetch_fd;
     int cpu;
+    ibs_cpu_stats_t stats;
 } ibs_cpu_t;
 
 static int       ibs_initialized    = 0;
@@ -79,6 +88,11 @@ static int       ibs_max_fetch_fd   = -1;
 static int       num_cpus           = 0;
 ibs_cpu_t *      ibs_cpus           = NULL;
 
+/* Stats that are not per CPU */
+static unsigned long ibs_num_polls       = 0;
+static unsigned long ibs_num_empty_polls = 0;
+static uint64_t      ibs_blocked_ns      = 0;
+
 
 extern int errno;
 
@@ -184,6 +198,25 @@ ibs_apply_options_on_cpu(int cpu)
     return 0;
 }
 
+/* Copy a user's CPU set into one of ours, allocating ours if needed */
+    static int
+ibs_set_cpu_set_option(ibs_cpu_set_t      ** ours,
+        const ibs_cpu_set_t * theirs)
+{
+    if (*ours == NULL) {
+        *ours = ibs_cpu_set_alloc(0);
+        if (*ours == NULL) {
+            ibs_error_no("Cannot allocate CPU set%s", "");
+            return -1;
+        }
+    }
+
+    if (theirs == NULL)
+        return ibs_cpu_set_online(*ours);
+
+    return ibs_cpu_set_copy(*ours, theirs);
+}
+
     int
 ibs_set_option(ibs_option_t opt,
         ibs_val_t    val)
@@ -236,11 +269,12 @@ ibs_set_option(ibs_option_t opt,
             break;
 
         case IBS_CPU_LIST:
-            ibs_debug("Setting the IBS_CPU_LIST for %d cores...", num_cpus);
-            for (int i = 0; i < num_cpus; i++)
-            {
-                ibs_debug("  Core %d: %d -> %d\n", i, (int)ibs_cpu_list[i], (int)((char *)val)[i]);
-                ibs_cpu_list[i] = ((char *)val)[i];
+            if (ibs_set_cpu_set_option(&ibs_cpu_list, (ibs_cpu_set_t *)val) < 0)
+                return -1;
+            if (ibs_debug_on) {
+                char buf[1024];
+                ibs_cpu_set_print(ibs_cpu_list, buf, sizeof(buf));
+                ibs_debug("Setting IBS_CPU_LIST to %s", buf);
             }
             break;
 
@@ -250,8 +284,13 @@ ibs_set_option(ibs_option_t opt,
             break;
 
         case IBS_DAEMON_CPU_LIST:
-            ibs_daemon_cpu_list = (word_t)val;
-            ibs_debug("Setting IBS_DAEMON_CPU_LIST to 0x%lx", ibs_daemon_cpu_list);
+            if (ibs_set_cpu_set_option(&ibs_daemon_cpu_list, (ibs_cpu_set_t *)val) < 0)
+                return -1;
+            if (ibs_debug_on) {
+                char buf[1024];
+                ibs_cpu_set_print(ibs_daemon_cpu_list, buf, sizeof(buf));
+                ibs_debug("Setting IBS_DAEMON_CPU_LIST to %s", buf);
+            }
             break;
 
         case IBS_DAEMON_OP_FILE:
@@ -276,6 +315,28 @@ ibs_set_option(ibs_option_t opt,
             ibs_debug("Set IBS_DAEMON_FETCH_WRITE %s", "");
             break;
 
+        case IBS_DAEMON_RING_NAME:
+            ibs_daemon_ring_name = (char *)val;
+            ibs_debug("Setting IBS_DAEMON_RING_NAME to %s",
+                    ibs_daemon_ring_name ? ibs_daemon_ring_name : "(none)");
+            break;
+
+        case IBS_DAEMON_RING_SAMPLES:
+            ibs_daemon_ring_samples = (unsigned long)val;
+            ibs_debug("Setting IBS_DAEMON_RING_SAMPLES to %lu", ibs_daemon_ring_samples);
+            break;
+
+        case IBS_DAEMON_STATS_INTERVAL:
+            ibs_daemon_stats_interval = (unsigned long)val;
+            ibs_debug("Setting IBS_DAEMON_STATS_INTERVAL to %lu ms", ibs_daemon_stats_interval);
+            break;
+
+        case IBS_DAEMON_STATS_FILE:
+            ibs_daemon_stats_file = (char *)val;
+            ibs_debug("Setting IBS_DAEMON_STATS_FILE to %s",
+                    ibs_daemon_stats_file ? ibs_daemon_stats_file : "(stderr)");
+            break;
+
         default:
             ibs_error("Unrecognized IBS option: %d", opt);
             return -1;
@@ -290,7 +351,7 @@ ibs_enable_cpu(int cpu)
     int status;
     ibs_cpu_t * ibs_cpu;
 
-    if (!ibs_cpu_list[cpu])
+    if (!ibs_cpu_set_is_set(ibs_cpu_list, cpu))
     {
         ibs_error("Trying to enable IBS on non-initialized CPU %d", cpu);
         return -1;
@@ -330,28 +391,25 @@ err:
     int
 ibs_enable_all(void)
 {
-    int cpu, status = 0;
+    int cpu, failed_cpu, status = 0;
 
-    for (cpu = 0; cpu < num_cpus; cpu++) {
-        ibs_debug("Checking if IBS is initialized for CPU %d: %d", cpu, ibs_cpu_list[cpu]);
-        if (ibs_cpu_list[cpu]) {
-            status = ibs_enable_cpu(cpu);
-            if (status < 0) {
-                ibs_error("Cannot enable IBS on cpu %d", cpu);
-                goto enable_err;
-            }
+    ibs_cpu_set_for_each(cpu, ibs_cpu_list) {
+        ibs_debug("Enabling IBS for CPU %d", cpu);
+        status = ibs_enable_cpu(cpu);
+        if (status < 0) {
+            ibs_error("Cannot enable IBS on cpu %d", cpu);
+            goto enable_err;
         }
     }
 
     return 0;
 
 enable_err:
-    while (cpu >= 0) {
-        if (ibs_cpu_list[cpu]) {
-            ibs_disable_cpu(cpu);
-        }
-
-        cpu--;
+    failed_cpu = cpu;
+    ibs_cpu_set_for_each(cpu, ibs_cpu_list) {
+        if (cpu > failed_cpu)
+            break;
+        ibs_disable_cpu(cpu);
     }
 
     return status;
@@ -363,7 +421,7 @@ ibs_disable_cpu(int cpu)
     int status;
     ibs_cpu_t * ibs_cpu;
 
-    if (!ibs_cpu_list[cpu]) {
+    if (!ibs_cpu_set_is_set(ibs_cpu_list, cpu)) {
         ibs_error("Trying to disble IBS on non-initialized CPU %d", cpu);
         return;
     }
@@ -396,11 +454,8 @@ ibs_disable_all(void)
 {
     int cpu;
 
-    for (cpu = 0; cpu < num_cpus; cpu++) {
-        if (ibs_cpu_list[cpu]) {
-            ibs_disable_cpu(cpu);
-        }
-    }
+    ibs_cpu_set_for_each(cpu, ibs_cpu_list)
+        ibs_disable_cpu(cpu);
 }
 
     static int
@@ -408,7 +463,8 @@ do_ibs_get_sample(ibs_sample_type_t   type,
         int                 fd,
         ibs_sample_t      * samples,
         int                 sample_off,
-        unsigned int        max_samples)
+        unsigned int        max_samples,
+        ibs_cpu_stats_t   * stats)
 {
     unsigned int samples_available;
     int bytes_wanted, bytes_read;
@@ -421,6 +477,7 @@ do_ibs_get_sample(ibs_sample_type_t   type,
             return -1;
 
         case 0:
+            stats->empty_wakeups++;
             ibs_error("No samples avaialable in fd %d", fd);
             return -1;
 
@@ -454,6 +511,7 @@ do_ibs_get_sample(ibs_sample_type_t   type,
         temp_fetch_buffer = malloc(bytes_wanted);
         bytes_read = read(fd, (void*)temp_fetch_buffer, bytes_wanted);
     }
+    stats->reads++;
 
     switch (bytes_read) {
         case -1:
@@ -498,6 +556,12 @@ do_ibs_get_sample(ibs_sample_type_t   type,
     if (temp_fetch_buffer != NULL)
         free(temp_fetch_buffer);
 
+    stats->bytes += bytes_read;
+    if (type == IBS_OP_SAMPLE)
+        stats->op_samples += samples_available;
+    else
+        stats->fetch_samples += samples_available;
+
     return samples_available;
 }
 
@@ -507,19 +571,16 @@ do_ibs_get_all_samples(int                 max_samples,
         ibs_sample_t      * samples,
         ibs_sample_type_t * sample_types,
         fd_set            * fd_set,
-        char *              cpu_list)
+        ibs_cpu_set_t     * cpu_list)
 {
     int total_new_samples, sample_off, new_samples, cpu;
 
     sample_off        = 0;
     total_new_samples = 0;
 
-    for (cpu = 0; cpu < num_cpus; cpu++) {
+    ibs_cpu_set_for_each(cpu, cpu_list) {
         ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
 
-        if (!cpu_list[cpu])
-            continue;
-
         /* aggressive_read -> don't even check if the fd has is set. The idea is that
          * at least one cpu has met the threshold, so it might make sense to read all
          * cpus now.
@@ -532,12 +593,16 @@ do_ibs_get_all_samples(int                 max_samples,
                 )
            )
         {
+            if (FD_ISSET(ibs_cpu->op_fd, fd_set))
+                ibs_cpu->stats.poll_wakeups++;
+
             new_samples = do_ibs_get_sample(
                     IBS_OP_SAMPLE,
                     ibs_cpu->op_fd,
                     samples,
                     sample_off,
-                    max_samples - total_new_samples);
+                    max_samples - total_new_samples,
+                    &(ibs_cpu->stats));
 
             if (new_samples < 0) {
                 ibs_error("Could not get OP sample from cpu %d", cpu);
@@ -567,12 +632,16 @@ do_ibs_get_all_samples(int                 max_samples,
                 )
            )
         {
+            if (FD_ISSET(ibs_cpu->fetch_fd, fd_set))
+                ibs_cpu->stats.poll_wakeups++;
+
             new_samples = do_ibs_get_sample(
                     IBS_FETCH_SAMPLE,
                     ibs_cpu->fetch_fd,
                     samples,
                     sample_off,
-                    max_samples - total_new_samples);
+                    max_samples - total_new_samples,
+                    &(ibs_cpu->stats));
 
             if (new_samples < 0) {
                 ibs_error("Could not get FETCH sample from cpu %d", cpu);
@@ -603,10 +672,11 @@ do_ibs_sample(int           max_samples,
         int                 sample_flags,
         ibs_sample_t      * samples,
         ibs_sample_type_t * sample_types,
-        char              * cpu_list)
+        ibs_cpu_set_t     * cpu_list)
 {
     int max_fd, cpu, status;
     struct timeval timeout;
+    struct timespec before, after;
     fd_set rfds;
 
     if (max_samples <= 0) {
@@ -623,22 +693,21 @@ do_ibs_sample(int           max_samples,
     }
 
     FD_ZERO(&rfds);
-    for (cpu = 0; cpu < num_cpus; cpu++) {
-        if (cpu_list[cpu]) {
-            ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
-            if ((sample_flags & IBS_OP_SAMPLE) && ibs_cpu->op_enabled) {
-                FD_SET(ibs_cpu->op_fd, &rfds);
-            }
+    ibs_cpu_set_for_each(cpu, cpu_list) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        if ((sample_flags & IBS_OP_SAMPLE) && ibs_cpu->op_enabled) {
+            FD_SET(ibs_cpu->op_fd, &rfds);
+        }
 
-            if ((sample_flags & IBS_FETCH_SAMPLE) && ibs_cpu->fetch_enabled) {
-                FD_SET(ibs_cpu->fetch_fd, &rfds);
-            }
+        if ((sample_flags & IBS_FETCH_SAMPLE) && ibs_cpu->fetch_enabled) {
+            FD_SET(ibs_cpu->fetch_fd, &rfds);
         }
     }
 
     /* Get max select fd */
     max_fd = (ibs_max_op_fd > ibs_max_fetch_fd) ? ibs_max_op_fd : ibs_max_fetch_fd;
 
+    clock_gettime(CLOCK_MONOTONIC, &before);
     if (ibs_poll_timeout > 0) {
         timeout.tv_sec  = (ibs_poll_timeout / MSEC_PER_SEC);
         timeout.tv_usec = (ibs_poll_timeout % MSEC_PER_SEC) * USEC_PER_MSEC;
@@ -646,6 +715,11 @@ do_ibs_sample(int           max_samples,
     } else {
         status = select(max_fd + 1, &rfds, NULL, NULL, NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+
+    ibs_num_polls++;
+    ibs_blocked_ns += (after.tv_sec - before.tv_sec) * NSEC_PER_SEC +
+        after.tv_nsec - before.tv_nsec;
 
     switch (status) {
         case -1:
@@ -662,6 +736,7 @@ do_ibs_sample(int           max_samples,
             return 0;
 
         case 0:
+            ibs_num_empty_polls++;
             ibs_debug("select timed out after %lu ms of no more than %lu samples",
                     ibs_poll_timeout,
                     ibs_poll_num_samples);
@@ -702,43 +777,60 @@ ibs_sample(int                 max_samples,
             ibs_cpu_list);
 }
 
-static int is_cpu_online(int cpu_num)
+    int
+ibs_get_stats(ibs_stats_t     * stats,
+        ibs_cpu_stats_t * per_cpu,
+        int               max_cpus)
 {
-    char *online_name;
+    ibs_cpu_stats_t * total;
+    int cpu, filled = 0;
 
-    // CPU 0 is the bootstrap processor and is always on
-    if (cpu_num == 0)
-        return 1;
-
-    int num_bytes = asprintf(&online_name,
-            "/sys/devices/system/cpu/cpu%d/online", cpu_num);
-    if (num_bytes <= 0)
-    {
-        fprintf(stderr, "asprintf failed at %s:%d\n", __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
-    }
-    FILE *online_fp = fopen(online_name, "r");
-    if (online_fp == NULL)
-    {
-        fprintf(stderr, "Could not open %s\n", online_name);
-        exit(EXIT_FAILURE);
+    if (!ibs_initialized) {
+        ibs_error("IBS not initialized. %s", "");
+        errno = EINVAL;
+        return -1;
     }
-    free(online_name);
 
-    char *online_cpus = NULL;
-    size_t len = 0;
-    ssize_t line_len = getline(&online_cpus, &len, online_fp);
-    if (line_len == -1 || len == 0)
-    {
-        fprintf(stderr, "Failed to read the number of online CPUs\n");
-        exit(EXIT_FAILURE);
+    memset(stats, 0, sizeof(ibs_stats_t));
+    total              = &(stats->total);
+    total->cpu         = -1;
+    stats->polls       = ibs_num_polls;
+    stats->empty_polls = ibs_num_empty_polls;
+    stats->blocked_ns  = ibs_blocked_ns;
+
+    ibs_cpu_set_for_each(cpu, ibs_cpu_list) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        ibs_cpu_stats_t * s = &(ibs_cpu->stats);
+        long lost;
+
+        /* The driver resets its lost counter on every GET_LOST, so keep a
+         * running total here. */
+        if (ibs_cpu->op_fd > 0) {
+            lost = ioctl(ibs_cpu->op_fd, GET_LOST);
+            if (lost > 0)
+                s->op_lost += lost;
+        }
+        if (ibs_cpu->fetch_fd > 0) {
+            lost = ioctl(ibs_cpu->fetch_fd, GET_LOST);
+            if (lost > 0)
+                s->fetch_lost += lost;
+        }
+
+        s->cpu = cpu;
+        total->op_samples    += s->op_samples;
+        total->fetch_samples += s->fetch_samples;
+        total->op_lost       += s->op_lost;
+        total->fetch_lost    += s->fetch_lost;
+        total->bytes         += s->bytes;
+        total->reads         += s->reads;
+        total->poll_wakeups  += s->poll_wakeups;
+        total->empty_wakeups += s->empty_wakeups;
+
+        if (per_cpu != NULL && filled < max_cpus)
+            per_cpu[filled++] = *s;
     }
-    fclose(online_fp);
 
-    if (online_cpus[0] == '1')
-        return 1;
-    else
-        return 0;
+    return filled;
 }
 
     static int
@@ -747,9 +839,9 @@ do_ibs_initialize(ibs_option_list_t * options,
 {
     char ibs_path[256];
     int status = 0, fd = 0, opt = 0, cpu = 0;
+    ibs_cpu_set_t * online_cpus;
 
     num_cpus = get_nprocs_conf();
-    ibs_cpu_list = calloc(num_cpus, sizeof(char));
 
     /* Save options */
     for (opt = 0; opt < num_options; opt++) {
@@ -757,8 +849,25 @@ do_ibs_initialize(ibs_option_list_t * options,
         ibs_set_option(o->opt, o->val);
     }
 
-    int online_cpus = get_nprocs();
-    ibs_debug("%d total cpus - %d cpus online", num_cpus, online_cpus);
+    /* Only CPUs that are both requested and online can be sampled. With no
+     * IBS_CPU_LIST, that is every online CPU. */
+    online_cpus = ibs_cpu_set_alloc(num_cpus);
+    if (online_cpus == NULL || ibs_cpu_set_online(online_cpus) < 0) {
+        ibs_error_no("Cannot find the online CPUs%s", "");
+        ibs_cpu_set_free(online_cpus);
+        return -1;
+    }
+
+    if (ibs_cpu_list == NULL &&
+            ibs_set_cpu_set_option(&ibs_cpu_list, NULL) < 0) {
+        ibs_cpu_set_free(online_cpus);
+        return -1;
+    }
+    ibs_cpu_set_and(ibs_cpu_list, online_cpus);
+
+    ibs_debug("%d total cpus - %d cpus online - %d cpus sampled", num_cpus,
+            ibs_cpu_set_count(online_cpus), ibs_cpu_set_count(ibs_cpu_list));
+    ibs_cpu_set_free(online_cpus);
 
     /* Allocate memory for cpu structs */
     ibs_cpus = malloc(sizeof(ibs_cpu_t) * num_cpus);
@@ -777,11 +886,8 @@ do_ibs_initialize(ibs_option_list_t * options,
     ibs_max_fetch_fd = -1;
 
     /* Open IBS files and store fds */
-    for (cpu = 0; cpu < num_cpus; cpu++) {
+    ibs_cpu_set_for_each(cpu, ibs_cpu_list) {
         ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
-        int online = is_cpu_online(cpu);
-        if (!online)
-            continue;
 
         if (ibs_op) {
             ibs_debug("Opening IBS-Op device on CPU %d", cpu);
@@ -829,7 +935,7 @@ do_ibs_initialize(ibs_option_list_t * options,
     return 0;
 
 err:
-    while (cpu >= 0) {
+    for (cpu = num_cpus - 1; cpu >= 0; cpu--) {
         ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
         if (ibs_cpu->op_fd > 0) {
             close(ibs_cpu->op_fd);
@@ -840,8 +946,6 @@ err:
             close(ibs_cpu->fetch_fd);
             ibs_cpu->fetch_fd = 0;
         }
-
-        cpu--;
     }
 
     free(ibs_cpus);
@@ -940,6 +1044,46 @@ sig_handler(int sig)
 }
 
 
+    static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* One CSV row per sampled CPU, then one for the whole daemon. The counters
+ * are running totals since the daemon started. */
+    static void
+write_ibs_stats(FILE            * fp,
+        double            elapsed,
+        ibs_cpu_stats_t * per_cpu,
+        int               max_cpus)
+{
+    ibs_stats_t stats;
+    int i, n;
+
+    n = ibs_get_stats(&stats, per_cpu, max_cpus);
+    if (n < 0)
+        return;
+
+    for (i = 0; i < n; i++) {
+        ibs_cpu_stats_t * s = &(per_cpu[i]);
+        fprintf(fp, "%.3f,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,,,\n",
+                elapsed, s->cpu, s->op_samples, s->fetch_samples,
+                s->op_lost, s->fetch_lost, s->bytes, s->reads,
+                s->poll_wakeups, s->empty_wakeups);
+    }
+
+    fprintf(fp, "%.3f,all,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.3f\n",
+            elapsed, stats.total.op_samples, stats.total.fetch_samples,
+            stats.total.op_lost, stats.total.fetch_lost, stats.total.bytes,
+            stats.total.reads, stats.total.poll_wakeups,
+            stats.total.empty_wakeups, stats.polls, stats.empty_polls,
+            (double)stats.blocked_ns / NSEC_PER_MSEC);
+    fflush(fp);
+}
+
 /* Setup a simple sample loop */
     static int
 start_ibs_daemon(void)
@@ -948,11 +1092,32 @@ start_ibs_daemon(void)
     ibs_sample_t      * samples      = NULL;
     ibs_sample_type_t * sample_types = NULL;
     FILE * op_fp = NULL, * fetch_fp  = NULL;
+    ibs_ring_t * ring = NULL;
     unsigned long num_ops = 0, num_fetches = 0, num_samples = 0;
+    FILE * stats_fp = NULL;
+    ibs_cpu_stats_t * per_cpu_stats = NULL;
+    uint64_t start_ns = 0, next_stats_ns = 0;
 
     if (!ibs_fetch && !ibs_op)
         return 0;
 
+    /* Keep the daemon off of the CPUs being measured, if asked to */
+    if (ibs_daemon_cpu_list != NULL) {
+        int cpu;
+        size_t set_size  = CPU_ALLOC_SIZE(ibs_daemon_cpu_list->num_cpus);
+        cpu_set_t * mask = CPU_ALLOC(ibs_daemon_cpu_list->num_cpus);
+
+        if (mask != NULL) {
+            CPU_ZERO_S(set_size, mask);
+            ibs_cpu_set_for_each(cpu, ibs_daemon_cpu_list)
+                CPU_SET_S(cpu, set_size, mask);
+
+            if (sched_setaffinity(0, set_size, mask) < 0)
+                ibs_error_no("Cannot pin the IBS daemon%s", "");
+            CPU_FREE(mask);
+        }
+    }
+
     /* Allocate some memory for the samples */
     samples = malloc(sizeof(ibs_sample_t) * ibs_daemon_max_samples);
     if (samples == NULL) {
@@ -967,8 +1132,20 @@ start_ibs_daemon(void)
         return -1;
     }
 
+    /* In broker mode, samples go to the shared ring instead of files */
+    if (ibs_daemon_ring_name != NULL)
+    {
+        ring = ibs_ring_create(ibs_daemon_ring_name, ibs_daemon_ring_samples);
+        if (ring == NULL) {
+            ibs_error("Cannot create sample ring %s", ibs_daemon_ring_name);
+            free(samples);
+            free(sample_types);
+            return -1;
+        }
+    }
+
     /* Open the op file */
-    if (ibs_op)
+    if (ibs_op && ring == NULL)
     {
         op_fp = fopen(ibs_daemon_op_file, "w");
         if (op_fp == NULL) {
@@ -980,7 +1157,7 @@ start_ibs_daemon(void)
     }
 
     /* Open the fetch file */
-    if (ibs_fetch)
+    if (ibs_fetch && ring == NULL)
     {
         fetch_fp = fopen(ibs_daemon_fetch_file, "w");
         if (fetch_fp == NULL) {
@@ -999,6 +1176,7 @@ start_ibs_daemon(void)
         ibs_error("Cannot enable IBS on all CPUs. Status: %d", status);
         free(sample_types);
         free(samples);
+        ibs_ring_destroy(ring);
         if (op_fp)
             fclose(op_fp);
         if (fetch_fp)
@@ -1006,6 +1184,29 @@ start_ibs_daemon(void)
         return status;
     }
 
+    /* Periodic stats go to their own file, or stderr */
+    if (ibs_daemon_stats_interval > 0)
+    {
+        per_cpu_stats = malloc(sizeof(ibs_cpu_stats_t) * num_cpus);
+        stats_fp = stderr;
+        if (ibs_daemon_stats_file != NULL)
+            stats_fp = fopen(ibs_daemon_stats_file, "w");
+
+        if (stats_fp == NULL || per_cpu_stats == NULL) {
+            ibs_error_no("Cannot set up stats output %s",
+                    ibs_daemon_stats_file ? ibs_daemon_stats_file : "");
+            if (stats_fp != NULL && stats_fp != stderr)
+                fclose(stats_fp);
+            stats_fp = NULL;
+        } else {
+            fprintf(stats_fp, "time_s,cpu,op_samples,fetch_samples,op_lost,"
+                    "fetch_lost,bytes,reads,poll_wakeups,empty_wakeups,"
+                    "polls,empty_polls,blocked_ms\n");
+            start_ns      = monotonic_ns();
+            next_stats_ns = start_ns + ibs_daemon_stats_interval * NSEC_PER_MSEC;
+        }
+    }
+
     /* Register a handler for the parent to kill us with  */
     signal(SIGUSR1, sig_handler);
 
@@ -1030,6 +1231,18 @@ start_ibs_daemon(void)
         if (new_samples >= 0)
             num_samples += new_samples;
 
+        if (stats_fp != NULL && monotonic_ns() >= next_stats_ns) {
+            uint64_t now = monotonic_ns();
+            write_ibs_stats(stats_fp, (double)(now - start_ns) / NSEC_PER_SEC,
+                    per_cpu_stats, num_cpus);
+            next_stats_ns = now + ibs_daemon_stats_interval * NSEC_PER_MSEC;
+        }
+
+        if (ring != NULL) {
+            ibs_ring_publish(ring, samples, sample_types, new_samples);
+            continue;
+        }
+
         for (i = 0; i < new_samples; i++) {
             ibs_sample_t * sample = &(samples[i]);
             ibs_sample_type_t   type   = sample_types[i];
@@ -1061,6 +1274,23 @@ start_ibs_daemon(void)
         fclose(fetch_fp);
     }
 
+    if (stats_fp)
+    {
+        write_ibs_stats(stats_fp,
+                (double)(monotonic_ns() - start_ns) / NSEC_PER_SEC,
+                per_cpu_stats, num_cpus);
+        if (stats_fp != stderr)
+            fclose(stats_fp);
+    }
+    free(per_cpu_stats);
+
+    if (ring)
+    {
+        ibs_debug("Published %lu samples to ring %s", num_samples,
+                ibs_daemon_ring_name);
+        ibs_ring_destroy(ring);
+    }
+
     free(samples);
     free(sample_types);
 
@@ -16,6 +16,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <sys/types.h>
 #include "ibs-uapi.h"
 
 
@@ -27,28 +28,47 @@ extern "C" {
 #define DEFAULT_IBS_POLL_TIMEOUT     1000
 #define DEFAULT_IBS_POLL_NUM_SAMPLES 4096
 #define DEFAULT_IBS_MAX_CNT			 0x3fff
-#define DEFAULT_IBS_CPU_LIST         (word_t)-1
+#define DEFAULT_IBS_CPU_LIST         NULL /* All online CPUs */
 
 #define DEFAULT_IBS_DAEMON_MAX_SAMPLES  10000
 #define DEFAULT_IBS_DAEMON_OP_FILE		"op.ibs"
 #define DEFAULT_IBS_DAEMON_FETCH_FILE	"fetch.ibs"
-#define DEFAULT_IBS_DAEMON_CPU_LIST     (word_t)-1
+#define DEFAULT_IBS_DAEMON_CPU_LIST     NULL /* Do not pin the daemon */
+#define DEFAULT_IBS_DAEMON_RING_NAME    NULL /* Write files, not a ring */
+#define DEFAULT_IBS_DAEMON_RING_SAMPLES (1 << 16)
+#define DEFAULT_IBS_DAEMON_STATS_INTERVAL 0    /* ms; 0 means never */
+#define DEFAULT_IBS_DAEMON_STATS_FILE   NULL /* stderr */
 
 
 
 typedef uint64_t word_t;
-#define BITS_PER_WORD  sizeof(word_t)
+#define BITS_PER_WORD  (sizeof(word_t) * 8)
 #define WORD_OFFSET(b) ((b) / BITS_PER_WORD)
 #define BIT_OFFSET(b)  ((b) % BITS_PER_WORD)
 
 #define SET_BIT(WORD, BIT) \
-    ((word_t *)&WORD)[WORD_OFFSET(BIT)] |= (1 << BIT_OFFSET(BIT))
+    ((word_t *)&(WORD))[WORD_OFFSET(BIT)] |= ((word_t)1 << BIT_OFFSET(BIT))
 
 #define CLEAR_BIT(WORD, BIT) \
-    ((word_t *)&WORD)[WORD_OFFSET(BIT)] &= ~(1 << BIT_OFFSET(BIT))
+    ((word_t *)&(WORD))[WORD_OFFSET(BIT)] &= ~((word_t)1 << BIT_OFFSET(BIT))
 
 #define IS_BIT_SET(WORD, BIT) \
-    !!(((word_t *)&WORD)[WORD_OFFSET(BIT)] & (1 << BIT_OFFSET(BIT)))
+    !!(((word_t *)&(WORD))[WORD_OFFSET(BIT)] & ((word_t)1 << BIT_OFFSET(BIT)))
+
+/* A set of CPUs, one bit per possible CPU. Sets are sized at allocation time
+ * (usually to get_nprocs_conf()) so they can describe any number of CPUs.
+ * IBS_CPU_LIST and IBS_DAEMON_CPU_LIST take a pointer to one of these. */
+typedef struct ibs_cpu_set {
+    int      num_cpus;   /* Number of CPUs this set can hold */
+    int      num_words;  /* Number of word_t in words[] */
+    word_t * words;
+} ibs_cpu_set_t;
+
+/* Iterate over every CPU in a set, lowest first */
+#define ibs_cpu_set_for_each(cpu, set) \
+    for ((cpu) = ibs_cpu_set_next((set), -1); \
+         (cpu) >= 0; \
+         (cpu) = ibs_cpu_set_next((set), (cpu)))
 
 typedef enum {
     IBS_DEBUG,
@@ -66,6 +86,10 @@ typedef enum {
     IBS_DAEMON_FETCH_FILE,
     IBS_DAEMON_OP_WRITE,
     IBS_DAEMON_FETCH_WRITE,
+    IBS_DAEMON_RING_NAME,
+    IBS_DAEMON_RING_SAMPLES,
+    IBS_DAEMON_STATS_INTERVAL,
+    IBS_DAEMON_STATS_FILE,
 } ibs_option_t;
 
 typedef void * ibs_val_t;
@@ -92,6 +116,225 @@ typedef struct ibs_sample {
 
 
 
+/* A batch of op samples stored as one array per field (structure of arrays)
+ * rather than one ibs_op_t per sample. Analyses that only need a few fields,
+ * e.g. rip[] and data3[], can scan just those arrays and use SIMD over them.
+ * Every array holds 'capacity' entries and starts on a 64-byte boundary;
+ * the first 'count' are valid. The 64-bit columns hold the raw register
+ * values, so they can be cast to the ibs_op_data3_t etc. unions. */
+typedef struct ibs_op_columns {
+    int        capacity;
+    int        count;
+    uint64_t * op_ctl;
+    uint64_t * rip;
+    uint64_t * data;
+    uint64_t * data2;
+    uint64_t * data3;
+    uint64_t * data4;
+    uint64_t * lin_ad;
+    uint64_t * phys_ad;
+    uint64_t * br_target;
+    uint64_t * tsc;
+    uint64_t * cr3;
+    int32_t  * tid;
+    int32_t  * pid;
+    int32_t  * cpu;
+    int32_t  * kern_mode;
+
+    /* Private to libIBS */
+    void              * mem;
+    ibs_sample_t      * scratch;
+    ibs_sample_type_t * scratch_types;
+    int                 scratch_len;
+} ibs_op_columns_t;
+
+ibs_op_columns_t *
+ibs_op_columns_alloc(int capacity);
+
+void
+ibs_op_columns_free(ibs_op_columns_t * cols);
+
+/* Transpose num_ops samples (at most cols->capacity) into cols */
+int
+ibs_op_columns_transpose(ibs_op_columns_t * cols,
+                         const ibs_op_t * ops,
+                         int num_ops);
+
+/* Like ibs_sample(), but for op samples only and returning them as columns */
+int
+ibs_sample_columns(int max_samples, ibs_op_columns_t * cols);
+
+/* Compressed traces.
+ *
+ * A compressed trace is a series of blocks, each an ibs_z_block_t followed
+ * by payload_size bytes of column-wise delta/XOR varint data. Any sample
+ * layout that is a whole number of 64-bit words (ibs_op_t, ibs_fetch_t)
+ * can be compressed. Fields are stored in host byte order. */
+#define IBS_Z_MAGIC "IBSZ"
+
+typedef struct ibs_z_block {
+    char     magic[4];      /* IBS_Z_MAGIC, with no terminating NUL */
+    uint32_t sample_size;   /* Bytes per decompressed sample */
+    uint32_t num_samples;
+    uint32_t payload_size;  /* Bytes that follow this header */
+} ibs_z_block_t;
+
+/* Largest block, including its header, that num_samples can compress to */
+size_t
+ibs_compress_bound(size_t sample_size, uint32_t num_samples);
+
+/* Compress num_samples samples into out, which must hold at least
+ * ibs_compress_bound() bytes. Returns the size of the whole block. */
+ssize_t
+ibs_compress_samples(const void * samples,
+                     size_t       sample_size,
+                     uint32_t     num_samples,
+                     void       * out,
+                     size_t       out_len);
+
+/* Decompress the payload that follows block into samples, which holds
+ * samples_len bytes. Returns the number of samples, or -1 with errno set
+ * to EINVAL if the block is corrupt or does not fit. */
+int
+ibs_decompress_samples(const ibs_z_block_t * block,
+                       const void          * payload,
+                       void                * samples,
+                       size_t                samples_len);
+
+/* The time on a clock at tsc, where the clock read from_ns at from_tsc and
+ * moves span_ns for every span_tsc the TSC moves, as when interpolating
+ * between two trace anchors (or, with a single anchor, span_tsc = TSC Hz
+ * and span_ns = 1e9). Rounded towards from_ns. */
+uint64_t
+ibs_tsc_to_ns(uint64_t tsc,
+              uint64_t from_tsc,
+              uint64_t from_ns,
+              int64_t  span_tsc,
+              int64_t  span_ns);
+
+/* Shared-memory sample rings.
+ *
+ * When IBS_DAEMON_RING_NAME is set, the libIBS daemon becomes a broker: it
+ * owns the IBS devices and publishes every sample it reads into a POSIX
+ * shared-memory ring of IBS_DAEMON_RING_SAMPLES entries instead of writing
+ * the op/fetch files. Any number of other processes (up to
+ * IBS_RING_MAX_READERS at once) can then attach to the ring by name and read
+ * the same stream. The broker never waits for slow readers; each reader has
+ * its own cursor and counts the samples that were overwritten before it got
+ * to them. */
+#define IBS_RING_MAX_READERS 16
+
+typedef struct ibs_ring ibs_ring_t;
+
+/* One reader's state, as kept in the shared segment */
+typedef struct ibs_ring_reader {
+    uint64_t cursor;   /* Next sample sequence number to read */
+    uint64_t dropped;  /* Samples overwritten before this reader saw them */
+    uint32_t in_use;   /* Set once the slot is ready to read from */
+    int32_t  pid;      /* Owner, or 0 if the slot is free */
+} __attribute__((aligned(64))) ibs_ring_reader_t;
+
+/* Broker side. num_samples is rounded up to a power of two. */
+ibs_ring_t *
+ibs_ring_create(const char * name, unsigned long num_samples);
+
+void
+ibs_ring_publish(ibs_ring_t * ring,
+                 const ibs_sample_t * samples,
+                 const ibs_sample_type_t * sample_types,
+                 int num_samples);
+
+/* Also removes the ring's name; attached readers see EPIPE from
+ * ibs_ring_wait() */
+void
+ibs_ring_destroy(ibs_ring_t * ring);
+
+/* Reader side. Returns NULL and sets errno if there is no such ring, it is
+ * from an incompatible libIBS, or every reader slot is taken (EBUSY). */
+ibs_ring_t *
+ibs_ring_attach(const char * name);
+
+void
+ibs_ring_detach(ibs_ring_t * ring);
+
+/* Copy out up to max_samples new samples without blocking */
+int
+ibs_ring_read(ibs_ring_t * ring,
+              int max_samples,
+              ibs_sample_t * samples,
+              ibs_sample_type_t * sample_types);
+
+/* Sleep until new samples are published or timeout_ms passes (-1 means
+ * forever). Returns -1 with errno EPIPE once the broker has gone away. */
+int
+ibs_ring_wait(ibs_ring_t * ring, int timeout_ms);
+
+/* Number of samples this reader has lost so far */
+unsigned long
+ibs_ring_dropped(const ibs_ring_t * ring);
+
+/* Snapshot of every attached reader, for monitoring the broker */
+int
+ibs_ring_get_readers(const ibs_ring_t * ring,
+                     ibs_ring_reader_t * readers,
+                     int max_readers);
+
+/* Allocate an empty CPU set. num_cpus <= 0 means get_nprocs_conf() */
+ibs_cpu_set_t *
+ibs_cpu_set_alloc(int num_cpus);
+
+void
+ibs_cpu_set_free(ibs_cpu_set_t *);
+
+void
+ibs_cpu_set_zero(ibs_cpu_set_t *);
+
+void
+ibs_cpu_set_fill(ibs_cpu_set_t *);
+
+/* Add/remove one CPU. Returns -1 if the CPU does not fit in the set */
+int
+ibs_cpu_set_add(ibs_cpu_set_t *, int cpu);
+
+int
+ibs_cpu_set_remove(ibs_cpu_set_t *, int cpu);
+
+int
+ibs_cpu_set_is_set(const ibs_cpu_set_t *, int cpu);
+
+/* Number of CPUs in the set */
+int
+ibs_cpu_set_count(const ibs_cpu_set_t *);
+
+/* First CPU in the set after prev (pass -1 to start), or -1 if none */
+int
+ibs_cpu_set_next(const ibs_cpu_set_t *, int prev);
+
+/* Highest CPU in the set, or -1 if the set is empty */
+int
+ibs_cpu_set_last(const ibs_cpu_set_t *);
+
+int
+ibs_cpu_set_copy(ibs_cpu_set_t * dst, const ibs_cpu_set_t * src);
+
+/* dst &= src */
+void
+ibs_cpu_set_and(ibs_cpu_set_t * dst, const ibs_cpu_set_t * src);
+
+/* Parse a list such as "0-63,128-191". Returns -1 and sets errno to EINVAL
+ * on a malformed list or a CPU that does not fit in the set. */
+int
+ibs_cpu_set_parse(ibs_cpu_set_t *, const char * list);
+
+/* Print the set in the same list format. Returns the string length, or -1
+ * if buf was too small. */
+int
+ibs_cpu_set_print(const ibs_cpu_set_t *, char * buf, int buf_len);
+
+/* Fill the set with the CPUs that are currently online */
+int
+ibs_cpu_set_online(ibs_cpu_set_t *);
+
 /* Initialize IBS with list of options */
 int
 ibs_initialize(ibs_option_list_t *, int num_opts, int daemonize);
@@ -119,6 +362,37 @@ ibs_enable_all(void);
 void
 ibs_disable_all(void);
 
+/* Counters that libIBS keeps for each CPU it reads from. They are only
+ * updated by the process that calls ibs_sample(), which is the daemon when
+ * IBS was initialized with daemonize set. */
+typedef struct ibs_cpu_stats {
+    int           cpu;
+    unsigned long op_samples;
+    unsigned long fetch_samples;
+    unsigned long op_lost;       /* Dropped by the driver; see GET_LOST */
+    unsigned long fetch_lost;
+    unsigned long bytes;         /* Bytes read from the driver */
+    unsigned long reads;         /* read() calls issued */
+    unsigned long poll_wakeups;  /* Times select() said this CPU was ready */
+    unsigned long empty_wakeups; /* Times we went to read and found nothing */
+} ibs_cpu_stats_t;
+
+typedef struct ibs_stats {
+    ibs_cpu_stats_t total;       /* Sum over every CPU; total.cpu is -1 */
+    unsigned long   polls;       /* select() calls */
+    unsigned long   empty_polls; /* select() calls that timed out */
+    uint64_t        blocked_ns;  /* Time spent waiting in select() */
+} ibs_stats_t;
+
+/* Fill in the aggregate stats and, if per_cpu is not NULL, one entry for
+ * each sampled CPU (up to max_cpus of them). Lost counts are collected from
+ * the driver here rather than in the read path. Returns the number of
+ * per_cpu entries filled in, or -1 on error. */
+int
+ibs_get_stats(ibs_stats_t     * stats,
+              ibs_cpu_stats_t * per_cpu,
+              int               max_cpus);
+
 /* Get some IBS samples */
 int
 ibs_sample(int				   max_samples,
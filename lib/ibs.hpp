@@ -0,0 +1,580 @@
+/*
+ * Copyright (C) 2015-2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in lib/LICENSE
+ *
+ * Header-only C++17 interface to libIBS. Everything here is a thin inline
+ * layer over the C API in ibs.h:
+ *   ibs::options        Typed builder for the ibs_option_list_t array
+ *   ibs::session        ibs_initialize() ... ibs_finalize()
+ *   ibs::enable_guard   ibs_enable_all() ... ibs_disable_all()
+ *   ibs::cpu_set        Owning wrapper around ibs_cpu_set_t
+ *   ibs::batch          Sample buffer that can be iterated over as op_view
+ *                       and fetch_view objects without copying samples
+ *   ibs::ring_reader    ibs_ring_attach() ... ibs_ring_detach()
+ * Errors from the C library are thrown as std::system_error using errno.
+ *
+ * Like the C library, only one session may exist per process.
+ */
+
+#ifndef __IBS_HPP__
+#define __IBS_HPP__
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "ibs.h"
+
+namespace ibs {
+
+[[noreturn]] inline void
+throw_errno(const char * what)
+{
+    throw std::system_error(errno ? errno : EINVAL, std::generic_category(),
+            what);
+}
+
+/* Owning CPU set. Converts to the ibs_cpu_set_t * the C API takes. A
+ * moved-from set holds no ibs_cpu_set_t (get() is nullptr) and reads as
+ * empty; adding a CPU to it gives it a fresh one. */
+class cpu_set {
+public:
+    /* Empty set that can hold num_cpus CPUs; <= 0 means all possible CPUs */
+    explicit cpu_set(int num_cpus = 0) : set_(ibs_cpu_set_alloc(num_cpus))
+    {
+        if (set_ == nullptr)
+            throw_errno("ibs_cpu_set_alloc");
+    }
+
+    ~cpu_set() { ibs_cpu_set_free(set_); }
+
+    cpu_set(const cpu_set & other) : set_(nullptr)
+    {
+        if (other.set_ == nullptr)
+            return;
+        set_ = ibs_cpu_set_alloc(other.set_->num_cpus);
+        if (set_ == nullptr)
+            throw_errno("ibs_cpu_set_alloc");
+        ibs_cpu_set_copy(set_, other.set_);
+    }
+
+    cpu_set & operator=(const cpu_set & other)
+    {
+        if (this != &other) {
+            cpu_set copy(other);
+            std::swap(set_, copy.set_);
+        }
+        return *this;
+    }
+
+    cpu_set(cpu_set && other) noexcept : set_(std::exchange(other.set_, nullptr)) {}
+
+    cpu_set & operator=(cpu_set && other) noexcept
+    {
+        std::swap(set_, other.set_);
+        return *this;
+    }
+
+    static cpu_set online()
+    {
+        cpu_set s;
+        if (ibs_cpu_set_online(s.set_) < 0)
+            throw_errno("ibs_cpu_set_online");
+        return s;
+    }
+
+    /* Kernel list format, e.g. "0-3,8" */
+    static cpu_set parse(const std::string & list)
+    {
+        cpu_set s;
+        if (ibs_cpu_set_parse(s.set_, list.c_str()) < 0)
+            throw_errno("ibs_cpu_set_parse");
+        return s;
+    }
+
+    cpu_set & add(int cpu)
+    {
+        if (set_ == nullptr)
+            *this = cpu_set();
+        ibs_cpu_set_add(set_, cpu);
+        return *this;
+    }
+
+    cpu_set & remove(int cpu)
+    {
+        if (set_ != nullptr)
+            ibs_cpu_set_remove(set_, cpu);
+        return *this;
+    }
+
+    bool contains(int cpu) const { return set_ != nullptr && ibs_cpu_set_is_set(set_, cpu); }
+    int  count() const           { return set_ != nullptr ? ibs_cpu_set_count(set_) : 0; }
+    int  last() const            { return set_ != nullptr ? ibs_cpu_set_last(set_) : -1; }
+
+    std::string str() const
+    {
+        if (set_ == nullptr)
+            return std::string();
+        std::string buf(16 + 8 * count(), '\0');
+        int len = ibs_cpu_set_print(set_, &buf[0], (int)buf.size());
+        buf.resize(len > 0 ? len : 0);
+        return buf;
+    }
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = int;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const int *;
+        using reference         = int;
+
+        iterator(const ibs_cpu_set_t * set, int cpu) : set_(set), cpu_(cpu) {}
+        int operator*() const { return cpu_; }
+        iterator & operator++() { cpu_ = ibs_cpu_set_next(set_, cpu_); return *this; }
+        bool operator==(const iterator & o) const { return cpu_ == o.cpu_; }
+        bool operator!=(const iterator & o) const { return cpu_ != o.cpu_; }
+    private:
+        const ibs_cpu_set_t * set_;
+        int cpu_;
+    };
+
+    iterator begin() const
+    {
+        return set_ != nullptr ? iterator(set_, ibs_cpu_set_next(set_, -1)) : end();
+    }
+    iterator end() const   { return iterator(set_, -1); }
+
+    ibs_cpu_set_t * get() const { return set_; }
+
+private:
+    ibs_cpu_set_t * set_;
+};
+
+/* Builds the option list for a session. Strings and CPU sets are copied,
+ * so the builder does not depend on the lifetime of its arguments. */
+class options {
+public:
+    using op_writer    = void (*)(FILE *, ibs_op_t *);
+    using fetch_writer = void (*)(FILE *, ibs_fetch_t *);
+
+    options & debug(bool on = true)           { return flag(IBS_DEBUG, on); }
+    options & op(bool on = true)              { return flag(IBS_OP, on); }
+    options & fetch(bool on = true)           { return flag(IBS_FETCH, on); }
+    options & aggressive_read(bool on = true) { return flag(IBS_AGGRESSIVE_READ, on); }
+    options & read_on_timeout(bool on = true) { return flag(IBS_READ_ON_TIMEOUT, on); }
+
+    options & poll_timeout(std::chrono::milliseconds ms)
+    {
+        return number(IBS_POLL_TIMEOUT, ms.count());
+    }
+
+    options & poll_num_samples(unsigned long n) { return number(IBS_POLL_NUM_SAMPLES, n); }
+    options & max_cnt(unsigned long cnt)        { return number(IBS_MAX_CNT, cnt); }
+    options & cpus(const cpu_set & set)         { return cpu_list(IBS_CPU_LIST, set); }
+
+    options & daemon_max_samples(unsigned long n) { return number(IBS_DAEMON_MAX_SAMPLES, n); }
+    options & daemon_cpus(const cpu_set & set)    { return cpu_list(IBS_DAEMON_CPU_LIST, set); }
+    options & daemon_op_file(std::string f)       { return string(IBS_DAEMON_OP_FILE, std::move(f)); }
+    options & daemon_fetch_file(std::string f)    { return string(IBS_DAEMON_FETCH_FILE, std::move(f)); }
+
+    /* The C API passes these as void *. Casting a function pointer to it
+     * is conditionally-supported since C++11; every POSIX compiler supports
+     * it, since dlsym() depends on the same conversion. */
+    options & daemon_op_write(op_writer fn)
+    {
+        return raw(IBS_DAEMON_OP_WRITE, reinterpret_cast<void *>(fn));
+    }
+
+    options & daemon_fetch_write(fetch_writer fn)
+    {
+        return raw(IBS_DAEMON_FETCH_WRITE, reinterpret_cast<void *>(fn));
+    }
+
+    options & daemon_ring(std::string name,
+            unsigned long num_samples = DEFAULT_IBS_DAEMON_RING_SAMPLES)
+    {
+        string(IBS_DAEMON_RING_NAME, std::move(name));
+        return number(IBS_DAEMON_RING_SAMPLES, num_samples);
+    }
+
+    options & daemon_stats(std::chrono::milliseconds interval)
+    {
+        return number(IBS_DAEMON_STATS_INTERVAL, interval.count());
+    }
+
+    options & daemon_stats(std::chrono::milliseconds interval, std::string file)
+    {
+        string(IBS_DAEMON_STATS_FILE, std::move(file));
+        return daemon_stats(interval);
+    }
+
+    /* Escape hatch for options this builder does not know about yet */
+    options & raw(ibs_option_t opt, ibs_val_t val)
+    {
+        list_.push_back(ibs_option_list_t{opt, val});
+        refs_.push_back(ref{ref::VALUE, 0});
+        return *this;
+    }
+
+    /* The list to hand to ibs_initialize(). String and CPU set options
+     * point into this object, so it must outlive the session. */
+    ibs_option_list_t * data()
+    {
+        for (size_t i = 0; i < list_.size(); i++) {
+            if (refs_[i].kind == ref::STRING)
+                list_[i].val = (ibs_val_t)strings_[refs_[i].index].c_str();
+            else if (refs_[i].kind == ref::CPU_SET)
+                list_[i].val = (ibs_val_t)sets_[refs_[i].index].get();
+        }
+        return list_.data();
+    }
+
+    int size() const { return (int)list_.size(); }
+
+private:
+    options & flag(ibs_option_t opt, bool on)
+    {
+        return raw(opt, (ibs_val_t)(unsigned long)on);
+    }
+
+    template <typename T>
+    options & number(ibs_option_t opt, T n)
+    {
+        return raw(opt, (ibs_val_t)(unsigned long)n);
+    }
+
+    options & string(ibs_option_t opt, std::string s)
+    {
+        strings_.push_back(std::move(s));
+        raw(opt, nullptr);
+        refs_.back() = ref{ref::STRING, strings_.size() - 1};
+        return *this;
+    }
+
+    options & cpu_list(ibs_option_t opt, const cpu_set & set)
+    {
+        sets_.push_back(set);
+        raw(opt, nullptr);
+        refs_.back() = ref{ref::CPU_SET, sets_.size() - 1};
+        return *this;
+    }
+
+    /* Pointers are only filled in by data(), so that copies of a builder
+     * point at their own strings and sets. */
+    struct ref {
+        enum { VALUE, STRING, CPU_SET } kind;
+        size_t index;
+    };
+
+    std::vector<ibs_option_list_t> list_;
+    std::vector<ref>                refs_;
+    std::vector<std::string>        strings_;
+    std::vector<cpu_set>            sets_;
+};
+
+/* ibs_initialize() for the lifetime of the object. With daemonize set, the
+ * daemon is started here and stopped by the destructor. */
+class session {
+public:
+    explicit session(options opts, bool daemonize = false)
+        : opts_(std::move(opts))
+    {
+        if (ibs_initialize(opts_.data(), opts_.size(), daemonize) != 0)
+            throw_errno("ibs_initialize");
+    }
+
+    ~session() { ibs_finalize(); }
+
+    session(const session &) = delete;
+    session & operator=(const session &) = delete;
+
+    ibs_stats_t stats(std::vector<ibs_cpu_stats_t> * per_cpu = nullptr) const
+    {
+        ibs_stats_t s;
+        int n = ibs_get_stats(&s, per_cpu ? per_cpu->data() : nullptr,
+                per_cpu ? (int)per_cpu->size() : 0);
+        if (n < 0)
+            throw_errno("ibs_get_stats");
+        if (per_cpu)
+            per_cpu->resize(n);
+        return s;
+    }
+
+private:
+    options opts_;  /* libIBS keeps pointers into these */
+};
+
+/* IBS is enabled on every sampled CPU while this is in scope */
+class enable_guard {
+public:
+    enable_guard()
+    {
+        if (ibs_enable_all() != 0)
+            throw_errno("ibs_enable_all");
+    }
+
+    ~enable_guard() { ibs_disable_all(); }
+
+    enable_guard(const enable_guard &) = delete;
+    enable_guard & operator=(const enable_guard &) = delete;
+};
+
+/* Read-only view of one op sample, with named accessors for the bitfields.
+ * raw() gives the underlying ibs_op_t for anything not covered here. */
+class op_view {
+public:
+    explicit op_view(const ibs_op_t & op) : op_(op) {}
+
+    const ibs_op_t & raw() const { return op_; }
+
+    uint64_t tsc() const         { return op_.tsc; }
+    uint64_t rip() const         { return op_.op_rip; }
+    uint64_t cr3() const         { return op_.cr3; }
+    int      cpu() const         { return op_.cpu; }
+    int      pid() const         { return op_.pid; }
+    int      tid() const         { return op_.tid; }
+    bool     kernel() const      { return op_.kern_mode != 0; }
+    bool     rip_valid() const   { return !op_.op_data.reg.ibs_rip_invalid; }
+
+    /* IBS_OP_DATA */
+    uint16_t comp_to_ret() const { return op_.op_data.reg.ibs_comp_to_ret_ctr; }
+    uint16_t tag_to_ret() const  { return op_.op_data.reg.ibs_tag_to_ret_ctr; }
+    bool     branch() const      { return op_.op_data.reg.ibs_op_brn_ret; }
+    bool     branch_taken() const { return op_.op_data.reg.ibs_op_brn_taken; }
+    bool     branch_mispredicted() const { return op_.op_data.reg.ibs_op_brn_misp; }
+    bool     ret() const         { return op_.op_data.reg.ibs_op_return; }
+    bool     microcode() const   { return op_.op_data.reg.ibs_op_microcode; }
+    uint64_t branch_target() const { return op_.br_target; }
+
+    /* IBS_OP_DATA2 */
+    uint8_t  nb_req_src() const  { return op_.op_data2.reg.ibs_nb_req_src; }
+
+    /* IBS_OP_DATA3 */
+    bool     load() const        { return op_.op_data3.reg.ibs_ld_op; }
+    bool     store() const       { return op_.op_data3.reg.ibs_st_op; }
+    bool     dc_miss() const     { return op_.op_data3.reg.ibs_dc_miss; }
+    bool     l2_miss() const     { return op_.op_data3.reg.ibs_l2_miss; }
+    bool     dc_l1_tlb_miss() const { return op_.op_data3.reg.ibs_dc_l1_tlb_miss; }
+    bool     dc_l2_tlb_miss() const { return op_.op_data3.reg.ibs_dc_l2_tlb_miss; }
+    bool     locked() const      { return op_.op_data3.reg.ibs_dc_locked_op; }
+    bool     sw_prefetch() const { return op_.op_data3.reg.ibs_sw_pf; }
+    uint8_t  mem_width() const   { return op_.op_data3.reg.ibs_op_mem_width; }
+    uint16_t dc_miss_latency() const { return op_.op_data3.reg.ibs_dc_miss_lat; }
+    uint16_t tlb_refill_latency() const { return op_.op_data3.reg.ibs_tlb_refill_lat; }
+    bool     lin_addr_valid() const  { return op_.op_data3.reg.ibs_lin_addr_valid; }
+    bool     phys_addr_valid() const { return op_.op_data3.reg.ibs_phy_addr_valid; }
+    uint64_t lin_addr() const    { return op_.dc_lin_ad; }
+    uint64_t phys_addr() const   { return op_.dc_phys_ad.reg.ibs_dc_phys_addr; }
+
+    const ibs_op_ctl_t   & ctl() const   { return op_.op_ctl; }
+    const ibs_op_data1_t & data() const  { return op_.op_data; }
+    const ibs_op_data2_t & data2() const { return op_.op_data2; }
+    const ibs_op_data3_t & data3() const { return op_.op_data3; }
+    const ibs_op_data4_t & data4() const { return op_.op_data4; }
+
+private:
+    const ibs_op_t & op_;
+};
+
+/* Read-only view of one fetch sample */
+class fetch_view {
+public:
+    explicit fetch_view(const ibs_fetch_t & fetch) : fetch_(fetch) {}
+
+    const ibs_fetch_t & raw() const { return fetch_; }
+
+    uint64_t tsc() const         { return fetch_.tsc; }
+    uint64_t cr3() const         { return fetch_.cr3; }
+    int      cpu() const         { return fetch_.cpu; }
+    int      pid() const         { return fetch_.pid; }
+    int      tid() const         { return fetch_.tid; }
+    bool     kernel() const      { return fetch_.kern_mode != 0; }
+
+    uint16_t latency() const     { return fetch_.fetch_ctl.reg.ibs_fetch_lat; }
+    bool     complete() const    { return fetch_.fetch_ctl.reg.ibs_fetch_comp; }
+    bool     ic_miss() const     { return fetch_.fetch_ctl.reg.ibs_ic_miss; }
+    bool     l1_tlb_miss() const { return fetch_.fetch_ctl.reg.ibs_l1_tlb_miss; }
+    bool     l2_tlb_miss() const { return fetch_.fetch_ctl.reg.ibs_l2_tlb_miss; }
+    bool     l2_miss() const     { return fetch_.fetch_ctl.reg.ibs_fetch_l2_miss; }
+    uint8_t  l1_tlb_page_size() const { return fetch_.fetch_ctl.reg.ibs_l1_tlb_pg_sz; }
+    bool     phys_addr_valid() const  { return fetch_.fetch_ctl.reg.ibs_phy_addr_valid; }
+    uint64_t lin_addr() const    { return fetch_.fetch_lin_ad; }
+    uint64_t phys_addr() const   { return fetch_.fetch_phys_ad.reg.ibs_fetch_phy_addr; }
+    uint16_t itlb_refill_latency() const { return fetch_.fetch_ctl_extd.reg.ibs_itlb_refill_lat; }
+
+    const ibs_fetch_ctl_t & ctl() const { return fetch_.fetch_ctl; }
+
+private:
+    const ibs_fetch_t & fetch_;
+};
+
+/* One sample of either type, as seen when iterating over a whole batch */
+class sample_view {
+public:
+    sample_view(const ibs_sample_t & s, ibs_sample_type_t type)
+        : sample_(s), type_(type) {}
+
+    ibs_sample_type_t type() const { return type_; }
+    bool is_op() const    { return type_ == IBS_OP_SAMPLE; }
+    bool is_fetch() const { return type_ == IBS_FETCH_SAMPLE; }
+    op_view    op() const    { return op_view(sample_.ibs_sample.op); }
+    fetch_view fetch() const { return fetch_view(sample_.ibs_sample.fetch); }
+
+private:
+    const ibs_sample_t & sample_;
+    ibs_sample_type_t type_;
+};
+
+/* A reusable buffer of samples. Fill it with read() (or read_from() a
+ * ring), then iterate over all(), ops() or fetches(). Iteration hands out
+ * views that point into the buffer; nothing is copied. */
+class batch {
+public:
+    explicit batch(int capacity)
+        : samples_(capacity), types_(capacity), count_(0) {}
+
+    /* Returns the number of samples read; 0 on timeout */
+    int read(int sample_flags = IBS_OP_SAMPLE | IBS_FETCH_SAMPLE)
+    {
+        int n = ibs_sample(capacity(), sample_flags, samples_.data(),
+                types_.data());
+        if (n < 0)
+            throw_errno("ibs_sample");
+        return count_ = n;
+    }
+
+    int read_from(ibs_ring_t * ring)
+    {
+        int n = ibs_ring_read(ring, capacity(), samples_.data(), types_.data());
+        if (n < 0)
+            throw_errno("ibs_ring_read");
+        return count_ = n;
+    }
+
+    int  capacity() const { return (int)samples_.size(); }
+    int  size() const     { return count_; }
+    bool empty() const    { return count_ == 0; }
+
+    /* Walks the samples, yielding only those whose type matches Want (or
+     * every sample when Want is 0) as View objects. */
+    template <int Want, typename View>
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = View;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = void;
+        using reference         = View;
+
+        /* Walks both arrays by pointer, as a hand-written C loop would,
+         * so that the compiler need not redo the index arithmetic for
+         * every sample that is yielded. */
+        iterator(const batch * b, int i)
+            : sample_(b->samples_.data() + i), type_(b->types_.data() + i),
+              end_(b->types_.data() + b->count_)
+        {
+            skip();
+        }
+
+        View operator*() const
+        {
+            if constexpr (Want == IBS_OP_SAMPLE)
+                return View(sample_->ibs_sample.op);
+            else if constexpr (Want == IBS_FETCH_SAMPLE)
+                return View(sample_->ibs_sample.fetch);
+            else
+                return View(*sample_, *type_);
+        }
+
+        iterator & operator++() { sample_++; type_++; skip(); return *this; }
+        bool operator==(const iterator & o) const { return type_ == o.type_; }
+        bool operator!=(const iterator & o) const { return type_ != o.type_; }
+
+    private:
+        void skip()
+        {
+            if constexpr (Want != 0) {
+                while (type_ != end_ && *type_ != Want) {
+                    sample_++;
+                    type_++;
+                }
+            }
+        }
+
+        const ibs_sample_t      * sample_;
+        const ibs_sample_type_t * type_;
+        const ibs_sample_type_t * end_;
+    };
+
+    template <int Want, typename View>
+    class range {
+    public:
+        explicit range(const batch * b) : b_(b) {}
+        iterator<Want, View> begin() const { return iterator<Want, View>(b_, 0); }
+        iterator<Want, View> end() const   { return iterator<Want, View>(b_, b_->count_); }
+    private:
+        const batch * b_;
+    };
+
+    range<0, sample_view>                 all() const     { return range<0, sample_view>(this); }
+    range<IBS_OP_SAMPLE, op_view>         ops() const     { return range<IBS_OP_SAMPLE, op_view>(this); }
+    range<IBS_FETCH_SAMPLE, fetch_view>   fetches() const { return range<IBS_FETCH_SAMPLE, fetch_view>(this); }
+
+    iterator<0, sample_view> begin() const { return all().begin(); }
+    iterator<0, sample_view> end() const   { return all().end(); }
+
+    ibs_sample_t      * data()  { return samples_.data(); }
+    ibs_sample_type_t * types() { return types_.data(); }
+
+private:
+    std::vector<ibs_sample_t>      samples_;
+    std::vector<ibs_sample_type_t> types_;
+    int count_;
+};
+
+/* Attached to a broker's shared-memory ring for the lifetime of the object */
+class ring_reader {
+public:
+    explicit ring_reader(const std::string & name)
+        : ring_(ibs_ring_attach(name.c_str()))
+    {
+        if (ring_ == nullptr)
+            throw_errno("ibs_ring_attach");
+    }
+
+    ~ring_reader() { ibs_ring_detach(ring_); }
+
+    ring_reader(const ring_reader &) = delete;
+    ring_reader & operator=(const ring_reader &) = delete;
+
+    int read(batch & b) { return b.read_from(ring_); }
+
+    /* Sleep until there may be new samples or the timeout passes. Returns
+     * false once the broker has gone away. */
+    bool wait(std::chrono::milliseconds timeout)
+    {
+        if (ibs_ring_wait(ring_, (int)timeout.count()) == 0)
+            return true;
+        if (errno == EPIPE)
+            return false;
+        throw_errno("ibs_ring_wait");
+    }
+
+    unsigned long dropped() const { return ibs_ring_dropped(ring_); }
+    ibs_ring_t * get() const      { return ring_; }
+
+private:
+    ibs_ring_t * ring_;
+};
+
+} /* namespace ibs */
+
+#endif /* __IBS_HPP__ */